@@ -14,9 +14,18 @@
     postPatch = ''
       cp ${./patch/src/lj_load.c}           src/lj_load.c
       cp ${./patch/src/lj_load_helper.cpp}  src/lj_load_helper.cpp
+      cp ${./patch/src/luajit_pro_aot.cpp}  src/luajit_pro_aot.cpp
+      cp ${./patch/src/luajit_pro_bench.cpp} src/luajit_pro_bench.cpp
+      cp ${./patch/src/luajit_pro_server.cpp} src/luajit_pro_server.cpp
       cp ${./patch/src/Makefile.dep}        src/Makefile.dep
       cp ${./patch/src/Makefile}            src/Makefile
     '' + old.postPatch;
     buildFlags = [];
+    postInstall = (old.postInstall or "") + ''
+      make -C src luajit-pro-aot
+      install -Dm755 src/luajit-pro-aot $out/bin/luajit-pro-aot
+      make -C src luajit-pro-server
+      install -Dm755 src/luajit-pro-server $out/bin/luajit-pro-server
+    '';
   });
 in luajit-pro
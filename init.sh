@@ -24,6 +24,9 @@ cp $luajit_dir/src/Makefile $luajit_backup_dir/src/Makefile
 #====================================================================================================
 cp $patch_dir/src/lj_load.c $luajit_dir/src/lj_load.c
 cp $patch_dir/src/lj_load_helper.cpp $luajit_dir/src/lj_load_helper.cpp
+cp $patch_dir/src/luajit_pro_aot.cpp $luajit_dir/src/luajit_pro_aot.cpp
+cp $patch_dir/src/luajit_pro_bench.cpp $luajit_dir/src/luajit_pro_bench.cpp
+cp $patch_dir/src/luajit_pro_server.cpp $luajit_dir/src/luajit_pro_server.cpp
 cp $patch_dir/src/Makefile.dep $luajit_dir/src/Makefile.dep
 cp $patch_dir/src/Makefile $luajit_dir/src/Makefile
 
@@ -5,3 +5,7 @@ install_dir=$(pwd)/luajit2.1
 
 cd $luajit_dir; make clean; make -j $(nproc); make install PREFIX=$install_dir
 
+# The ahead-of-time compiler and the transform server are not part of the LuaJIT install target
+make -C $luajit_dir/src -j $(nproc) luajit-pro-aot; install -Dm755 $luajit_dir/src/luajit-pro-aot $install_dir/bin/luajit-pro-aot
+make -C $luajit_dir/src -j $(nproc) luajit-pro-server; install -Dm755 $luajit_dir/src/luajit-pro-server $install_dir/bin/luajit-pro-server
+
@@ -25,20 +25,53 @@
 
 #ifdef LUAJIT_SYNTAX_EXTEND
 #include "assert.h"
+#include <pthread.h>
 #include <stdlib.h>
+#include "luajit.h"
 
 #define PURPLE_COLOR "\033[35m"
 #define RESET_COLOR "\033[0m"
 
+#define LJP_STR_(x) #x
+#define LJP_STR(x) LJP_STR_(x)
+// The cached bytecode is only loaded by the same VM. LUAJIT_VERSION is generated from luajit_relver.txt(the timestamp of the git revision),
+// so the tag changes with the sources of the VM and not with the time of the build, which keeps the builds reproducible.
+#define LJP_VM_TAG LUAJIT_VERSION " " LJ_ARCH_NAME " bc" LJP_STR(BCDUMP_VERSION) " fr2=" LJP_STR(LJ_FR2) " gc64=" LJP_STR(LJ_GC64)
+
+// The tag for the bytecode written by luajit-pro-aot, which can not see the internal headers of the VM
+const char *ljp_vm_tag(void) { return LJP_VM_TAG; }
+
 typedef const char *(* LuaDoStringPtr)(const char*, const char*);
-char *file_transform(const char *filename, LuaDoStringPtr func);
-void string_transform(const char *str, size_t *output_size);
+char *file_transform(const char *filename, const char *source, size_t source_size, LuaDoStringPtr func, size_t *output_size);
+int bytecode_cache_enabled(LuaDoStringPtr func);
+char *bytecode_cache_load(const char *filename, const char *source, size_t source_size, const char *vm_tag, LuaDoStringPtr func, size_t *output_size);
+void bytecode_cache_store(const char *filename, const char *source, size_t source_size, const char *vm_tag, LuaDoStringPtr func, const char *bytecode, size_t bytecode_size);
+char *string_transform(const char *name, const char *source, size_t source_size, LuaDoStringPtr func, size_t *output_size);
+void *stream_transform_open(const char *filename, const char *source, size_t source_size, LuaDoStringPtr func);
+const char *stream_transform_next(void *stream, size_t *size);
+void stream_transform_close(void *stream);
+const char *source_map(int fd, size_t *size, void **handle);
+void source_unmap(void *handle);
+int trace_enabled(void);
+uint64_t trace_clock(void);
+void trace_span(const char *name, const char *file, size_t bytes, uint64_t start);
+int archive_enabled(void);
+const char *archive_find(const char *name, size_t *size, const char **chunkname);
 void luaL_openlibs(lua_State *L);
 
+static pthread_key_t do_string_key;
+static pthread_once_t do_string_once = PTHREAD_ONCE_INIT;
+
+static void do_string_close(void *L) { lua_close((lua_State *)L); }
+
+static void do_string_key_init(void) { pthread_key_create(&do_string_key, do_string_close); }
+
+// Each thread has its own compile time lua_State, so VMs on different threads can load luajit-pro code concurrently. The state is closed
+// when the thread exits(e.g. the workers of luajit-pro-aot and of the parallel transform), through the destructor of a pthread key.
 const char *do_lua_stiring(const char *code_name, const char *str) {
-    static lua_State *L;
-    static char init = 0;
-    static char verbose = 0;
+    static __thread lua_State *L;
+    static __thread char init = 0;
+    static __thread char verbose = 0;
     if (init == 0) {
       init = 1;
 
@@ -50,6 +83,8 @@ const char *do_lua_stiring(const char *code_name, const char *str) {
 
       L = luaL_newstate();
       luaL_openlibs(L);
+      pthread_once(&do_string_once, do_string_key_init);
+      pthread_setspecific(do_string_key, L);
 
       // Preload the code that will be used to transform the code
       const char *code_str = 
@@ -60,8 +95,16 @@ const char *do_lua_stiring(const char *code_name, const char *str) {
         "function print(...) old_print(purple .. \"[comp_time]\" .. reset, ...) end\n"
         "function printf(...) io.write(purple .. \"[comp_time]\" .. reset .. \"\t\" .. string.format(...)) end\n"
         "env_vars = {}\n"
+        "__ljp_env_reads = {}\n"
+        "function __ljp_take_env_reads()\n" // Names of the env_vars read since the last call, the $comp_time cache depends on them
+        "  local names = {}\n"
+        "  for name in pairs(__ljp_env_reads) do names[#names + 1] = name end\n"
+        "  __ljp_env_reads = {}\n"
+        "  return table.concat(names, \"\\n\")\n"
+        "end\n"
         "setmetatable(env_vars, {\n"
         "    __index = function(table, key)\n"
+        "       __ljp_env_reads[key] = true\n"
         "       local value = os.getenv(key)\n"
         "       if value == nil then\n"
         "         printf(\"[warn] env_vars[%s] is nill!\\n\", key)\n"
@@ -95,6 +138,7 @@ const char *do_lua_stiring(const char *code_name, const char *str) {
         // Clean up the stack by popping the error message
         lua_pop(L, 1); // Remove the error message from the stack
 
+        pthread_setspecific(do_string_key, NULL);
         lua_close(L); // Close the Lua state
         printf("code_str " PURPLE_COLOR ">>>\n%s\n<<<" RESET_COLOR "\n", code_str);
         assert(0 && "Error executing luaCode");
@@ -110,6 +154,7 @@ const char *do_lua_stiring(const char *code_name, const char *str) {
       // Clean up the stack by popping the error message
       lua_pop(L, 1); // Remove the error message from the stack
 
+      pthread_setspecific(do_string_key, NULL);
       lua_close(L); // Close the Lua state
       printf("code_str >>> " PURPLE_COLOR "\n%s\n" RESET_COLOR "<<<\n", str);
       assert(0 && "Error executing luaCode");
@@ -190,15 +235,63 @@ typedef struct FileReaderCtx {
 #ifdef LUAJIT_SYNTAX_EXTEND
   char filename[256]; /* Max 255 + 1 for null terminator. */
   unsigned char is_first_access;
+  char *chunk; /* The transformed chunk or the cached bytecode, handed to the parser at once. */
+  size_t chunk_size; /* The total size of the pieces of a stream. */
+  void *stream; /* Streaming transform of a large file, the chunk is handed to the parser piece by piece. */
+  unsigned char bc_mode; /* The load mode allows the chunk to be replaced by bytecode. */
+  unsigned char bc_store; /* The bytecode of the chunk should be cached. */
+  const char *source; /* The original source, kept until the chunk is parsed if its bytecode should be cached or it is streamed. */
+  size_t source_size;
+  void *source_map; /* The source is mapped rather than read, see source_map(). */
 #endif // LUAJIT_SYNTAX_EXTEND
   FILE *fp;
   char buf[LUAL_BUFFERSIZE];
 } FileReaderCtx;
 
+#ifdef LUAJIT_SYNTAX_EXTEND
+// Only the first line(at most 255 characters) is checked for the "--[[luajit-pro]]" directive.
+static int has_pro_directive(const char *buf, size_t size)
+{
+  char first_line_buffer[256];
+  size_t n = 0;
+  while (n < size && n < sizeof(first_line_buffer) - 1 && buf[n] != '\n') n++;
+  memcpy(first_line_buffer, buf, n);
+  first_line_buffer[n] = '\0';
+  return strstr(first_line_buffer, "--[[luajit-pro]]") != NULL;
+}
+
+// Read the rest of the file after the first block, so that the source is only read once.
+static char *read_whole_file(FileReaderCtx *ctx, size_t first_size, size_t *size)
+{
+  size_t cap = first_size * 2 + LUAL_BUFFERSIZE;
+  char *source = (char *)malloc(cap);
+  assert(source != NULL && "Out of memory!");
+  memcpy(source, ctx->buf, first_size);
+  *size = first_size;
+  while (!feof(ctx->fp) && !ferror(ctx->fp)) {
+    if (cap - *size < LUAL_BUFFERSIZE) {
+      cap *= 2;
+      source = (char *)realloc(source, cap);
+      assert(source != NULL && "Out of memory!");
+    }
+    *size += fread(source + *size, 1, cap - *size, ctx->fp);
+  }
+  return source;
+}
+#endif // LUAJIT_SYNTAX_EXTEND
+
 static const char *reader_file(lua_State *L, void *ud, size_t *size)
 {
   FileReaderCtx *ctx = (FileReaderCtx *)ud;
   UNUSED(L);
+#ifdef LUAJIT_SYNTAX_EXTEND
+  if (ctx->chunk != NULL) return NULL; /* The transformed chunk has been consumed. */
+  if (ctx->stream != NULL) {
+    const char *piece = stream_transform_next(ctx->stream, size);
+    ctx->chunk_size += *size;
+    return piece;
+  }
+#endif // LUAJIT_SYNTAX_EXTEND
   if (feof(ctx->fp)) return NULL;
 
 #ifdef LUAJIT_SYNTAX_EXTEND
@@ -206,23 +299,49 @@ static const char *reader_file(lua_State *L, void *ud, size_t *size)
     // The file read by LuaJIT is seperated by many parts to avoid stack overflow for some large files.
     ctx->is_first_access = 0;
 
-    char first_line_buffer[256];
-    const char* substring = "--[[luajit-pro]]";
-
-    if (fgets(first_line_buffer, sizeof(first_line_buffer), ctx->fp) != NULL) {
-      if (strstr(first_line_buffer, substring) != NULL) {
-        char *new_file = file_transform(ctx->filename, do_lua_stiring);
-        // printf("[Debug]new_file => %s\n", new_file);fflush(stdout);
-        fclose(ctx->fp);
-        ctx->fp = fopen(new_file, "rb");
-        free(new_file);
-      } else {
-        // The read file did not contains "--[[luajit-pro]]"
+    // The directive is sniffed from the first block, which is returned as is for plain Lua files.
+    uint64_t trace_start = trace_enabled() ? trace_clock() : 0;
+    *size = fread(ctx->buf, 1, sizeof(ctx->buf), ctx->fp);
+    if (*size == 0) return NULL;
+    int is_pro = has_pro_directive(ctx->buf, *size);
+    if (trace_start) trace_span("sniff", ctx->filename, *size, trace_start);
+
+    if (is_pro) {
+      // The source is mapped and handed to the transformer without a copy, only a file which can not be mapped(e.g. a pipe) is read.
+      size_t source_size;
+      void *map = NULL;
+      const char *source = source_map(fileno(ctx->fp), &source_size, &map);
+      if (source == NULL)
+        source = read_whole_file(ctx, *size, &source_size);
+      int use_bc_cache = ctx->bc_mode && bytecode_cache_enabled(do_lua_stiring);
+      if (use_bc_cache)
+        ctx->chunk = bytecode_cache_load(ctx->filename, source, source_size, LJP_VM_TAG, do_lua_stiring, &ctx->chunk_size);
+      if (ctx->chunk == NULL) {
+        // A large file is transformed while the parser consumes it, the stream reads the source until it ends.
+        ctx->stream = stream_transform_open(ctx->filename, source, source_size, do_lua_stiring);
+        if (ctx->stream == NULL)
+          ctx->chunk = file_transform(ctx->filename, source, source_size, do_lua_stiring, &ctx->chunk_size);
+        ctx->bc_store = use_bc_cache;
+        if (use_bc_cache || ctx->stream != NULL) {
+          ctx->source = source;
+          ctx->source_size = source_size;
+          ctx->source_map = map;
+          source = NULL;
+        }
       }
-      fseek(ctx->fp, 0, SEEK_SET);
-    } else {
-      assert(0 && "Cannot read the file!");
+      if (source != NULL) {
+        if (map != NULL) source_unmap(map);
+        else free((char *)source);
+      }
+      if (ctx->stream != NULL) {
+        const char *piece = stream_transform_next(ctx->stream, size);
+        ctx->chunk_size = *size;
+        return piece;
+      }
+      *size = ctx->chunk_size;
+      return ctx->chunk;
     }
+    return ctx->buf;
   }
 #endif // LUAJIT_SYNTAX_EXTEND
 
@@ -230,12 +349,114 @@ static const char *reader_file(lua_State *L, void *ud, size_t *size)
   return *size > 0 ? ctx->buf : NULL;
 }
 
+#ifdef LUAJIT_SYNTAX_EXTEND
+typedef struct ArchiveReaderCtx {
+  const char *data;
+  size_t size;
+} ArchiveReaderCtx;
+
+// The archived code has already been transformed, so it is handed to the parser as is.
+static const char *reader_archive(lua_State *L, void *ud, size_t *size)
+{
+  ArchiveReaderCtx *ctx = (ArchiveReaderCtx *)ud;
+  UNUSED(L);
+  if (ctx->size == 0) return NULL;
+  *size = ctx->size;
+  ctx->size = 0;
+  return ctx->data;
+}
+
+// package.loaders entry for the modules in the LJP_ARCHIVE archives.
+static int archive_searcher(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const char *chunkname;
+  ArchiveReaderCtx ctx;
+  ctx.data = archive_find(name, &ctx.size, &chunkname);
+  if (ctx.data == NULL) {
+    lua_pushfstring(L, "\n\tno module " LUA_QS " in the luajit-pro archives", name);
+    return 1;
+  }
+  if (lua_loadx(L, reader_archive, &ctx, chunkname, NULL) != 0)
+    luaL_error(L, "error loading module " LUA_QS " from the luajit-pro archives:\n\t%s", name, lua_tostring(L, -1));
+  return 1;
+}
+
+// Registry key of the mark of the states which have the archive searcher.
+static const char archive_key = 0;
+
+// Put the archive searcher right after the preload searcher, so the archives are searched before the filesystem.
+// It is done on the first load of a file or of a luajit-pro buffer by every lua_State once the package library is open, e.g. the main script.
+static void archive_install(lua_State *L)
+{
+  int n, i;
+  // The state is marked once the searcher is installed, later loads only pay for a raw lookup by a light userdata key.
+  lua_pushlightuserdata(L, (void *)&archive_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  n = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (n) return;
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, "package");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 2);
+    return;
+  }
+  lua_getfield(L, -1, "loaders");
+  if (lua_istable(L, -1)) {
+    n = (int)lua_objlen(L, -1);
+    for (i = n; i >= 2; i--) {
+      lua_rawgeti(L, -1, i);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushcfunction(L, archive_searcher);
+    lua_rawseti(L, -2, n >= 1 ? 2 : 1);
+    lua_pushlightuserdata(L, (void *)&archive_key);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+  lua_pop(L, 3);
+}
+
+typedef struct BytecodeBuf {
+  char *data;
+  size_t size;
+  size_t cap;
+} BytecodeBuf;
+
+static int writer_bytecode(lua_State *L, const void *p, size_t size, void *ud)
+{
+  BytecodeBuf *buf = (BytecodeBuf *)ud;
+  UNUSED(L);
+  if (buf->cap - buf->size < size) {
+    buf->cap = (buf->cap + size) * 2;
+    buf->data = (char *)realloc(buf->data, buf->cap);
+    assert(buf->data != NULL && "Out of memory!");
+  }
+  memcpy(buf->data + buf->size, p, size);
+  buf->size += size;
+  return 0;
+}
+
+// Dump the freshly parsed function on the top of the stack into the bytecode cache.
+static void store_bytecode(lua_State *L, FileReaderCtx *ctx)
+{
+  BytecodeBuf buf = {NULL, 0, 0};
+  if (lua_dump(L, writer_bytecode, &buf) == 0 && buf.size > 0)
+    bytecode_cache_store(ctx->filename, ctx->source, ctx->source_size, LJP_VM_TAG, do_lua_stiring, buf.data, buf.size);
+  free(buf.data);
+}
+#endif // LUAJIT_SYNTAX_EXTEND
+
 LUALIB_API int luaL_loadfilex(lua_State *L, const char *filename,
 			      const char *mode)
 {
   FileReaderCtx ctx;
   int status;
   const char *chunkname;
+#ifdef LUAJIT_SYNTAX_EXTEND
+  if (archive_enabled()) archive_install(L);
+#endif // LUAJIT_SYNTAX_EXTEND
   if (filename) {
     ctx.fp = fopen(filename, "rb");
     if (ctx.fp == NULL) {
@@ -258,9 +479,34 @@ LUALIB_API int luaL_loadfilex(lua_State *L, const char *filename,
 
   // A flag that indicates whether it is the first access to the file.
   ctx.is_first_access = 1;
+  ctx.chunk = NULL;
+  ctx.chunk_size = 0;
+  ctx.stream = NULL;
+  ctx.bc_store = 0;
+  // The bytecode cache is not used if bytecode is rejected by the mode or a non-native prototype is requested.
+  ctx.bc_mode = mode == NULL || (strchr(mode, 'b') != NULL && strchr(mode, 'W') == NULL && strchr(mode, 'X') == NULL);
+  ctx.source = NULL;
+  ctx.source_size = 0;
+  ctx.source_map = NULL;
+  // The LuaJIT parser runs inside lua_loadx(), after the reader has handed over the transformed chunk.
+  uint64_t trace_start = trace_enabled() ? trace_clock() : 0;
 #endif // LUAJIT_SYNTAX_EXTEND
 
   status = lua_loadx(L, reader_file, &ctx, chunkname, mode);
+#ifdef LUAJIT_SYNTAX_EXTEND
+  if (trace_start && (ctx.chunk != NULL || ctx.stream != NULL))
+    trace_span("lua_loadx", ctx.filename, ctx.chunk_size, trace_start);
+  // The cache entry of a stream is complete once the parser has read it to the end, so it is closed before the bytecode is stored.
+  if (ctx.stream != NULL)
+    stream_transform_close(ctx.stream);
+  if (status == LUA_OK && ctx.bc_store)
+    store_bytecode(L, &ctx);
+  if (ctx.source_map != NULL)
+    source_unmap(ctx.source_map);
+  else
+    free((char *)ctx.source);
+  free(ctx.chunk);
+#endif // LUAJIT_SYNTAX_EXTEND
   if (ferror(ctx.fp)) {
     L->top -= filename ? 2 : 1;
     lua_pushfstring(L, "cannot read %s: %s", chunkname+1, strerror(errno));
@@ -282,6 +528,11 @@ LUALIB_API int luaL_loadfile(lua_State *L, const char *filename)
 }
 
 typedef struct StringReaderCtx {
+#ifdef LUAJIT_SYNTAX_EXTEND
+  const char *name;
+  int is_pro; /* The buffer starts with the directive. */
+  char *chunk; /* The transformed chunk, if the buffer has the directive. */
+#endif // LUAJIT_SYNTAX_EXTEND
   const char *str;
   size_t size;
 } StringReaderCtx;
@@ -295,7 +546,10 @@ static const char *reader_string(lua_State *L, void *ud, size_t *size)
   ctx->size = 0;
 
 #ifdef LUAJIT_SYNTAX_EXTEND
-  string_transform(ctx->str, size);
+  if (ctx->is_pro) {
+    ctx->chunk = string_transform(ctx->name, ctx->str, *size, do_lua_stiring, size);
+    return ctx->chunk;
+  }
 #endif // LUAJIT_SYNTAX_EXTEND
 
   return ctx->str;
@@ -305,9 +559,27 @@ LUALIB_API int luaL_loadbufferx(lua_State *L, const char *buf, size_t size,
 				const char *name, const char *mode)
 {
   StringReaderCtx ctx;
+  int status;
   ctx.str = buf;
   ctx.size = size;
-  return lua_loadx(L, reader_string, &ctx, name, mode);
+#ifdef LUAJIT_SYNTAX_EXTEND
+  // Unlike files, buffers must start with the directive, so plain chunks only pay for one memcmp.
+  ctx.is_pro = size >= 16 && memcmp(buf, "--[[luajit-pro]]", 16) == 0;
+  ctx.name = name ? name : "?";
+  ctx.chunk = NULL;
+  uint64_t trace_start = 0;
+  if (ctx.is_pro) {
+    if (archive_enabled()) archive_install(L);
+    trace_start = trace_enabled() ? trace_clock() : 0;
+  }
+#endif // LUAJIT_SYNTAX_EXTEND
+  status = lua_loadx(L, reader_string, &ctx, name, mode);
+#ifdef LUAJIT_SYNTAX_EXTEND
+  if (trace_start && ctx.chunk != NULL)
+    trace_span("lua_loadx", ctx.name, size, trace_start);
+  free(ctx.chunk);
+#endif // LUAJIT_SYNTAX_EXTEND
+  return status;
 }
 
 LUALIB_API int luaL_loadbuffer(lua_State *L, const char *buf, size_t size,
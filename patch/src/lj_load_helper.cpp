@@ -1,23 +1,53 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <ostream>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #define LJ_PRO_CACHE_DIR "./.luajit_pro"
+#define LJ_PRO_VERSION "0.5.0" // Bump this whenever the generated code changes, it is part of the cache key
+#define LJ_PRO_STREAM_WINDOW (4 << 20) // Preprocessed bytes per window of the streaming transform, a window ends at the next boundary after it
+#define LJ_PRO_PARALLEL_SEGMENT (1 << 20) // Min bytes per segment of the parallel transform, see transformParallel()
 
 typedef const char *(*LuaDoStringPtr)(const char *, const char *);
+typedef void (*TraceSinkPtr)(const char *name, const char *file, size_t bytes, uint64_t start, uint64_t end);
 
 #define ASSERT(condition, ...)                                                                                                                                                                                                                                                                                                                                                                                 \
     do {                                                                                                                                                                                                                                                                                                                                                                                                       \
@@ -27,22 +57,198 @@ typedef const char *(*LuaDoStringPtr)(const char *, const char *);
         }                                                                                                                                                                                                                                                                                                                                                                                                      \
     } while (0)
 
-extern "C" const char *file_transform(const char *filename, LuaDoStringPtr func);
+extern "C" char *file_transform(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize);
+extern "C" int bytecode_cache_enabled(LuaDoStringPtr func);
+extern "C" char *bytecode_cache_load(const char *filename, const char *source, size_t sourceSize, const char *vmTag, LuaDoStringPtr func, size_t *outputSize);
+extern "C" void bytecode_cache_store(const char *filename, const char *source, size_t sourceSize, const char *vmTag, LuaDoStringPtr func, const char *bytecode, size_t bytecodeSize);
+extern "C" char *string_transform(const char *name, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize);
+extern "C" int trace_enabled(void);
+extern "C" uint64_t trace_clock(void);
+extern "C" void trace_span(const char *name, const char *file, size_t bytes, uint64_t start);
+extern "C" void trace_set_sink(TraceSinkPtr sink);
+extern "C" int archive_enabled(void);
+extern "C" const char *archive_find(const char *name, size_t *size, const char **chunkname);
+extern "C" int transform_server(const char *socketPath, LuaDoStringPtr func);
+extern "C" int archive_write(const char *filename, size_t count, const char *const *names, const char *const *chunknames, const char *const *data, const size_t *sizes);
+extern "C" void *stream_transform_open(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func);
+extern "C" const char *stream_transform_next(void *stream, size_t *size);
+extern "C" void stream_transform_close(void *stream);
+extern "C" const char *source_map(int fd, size_t *size, void **handle);
+extern "C" void source_unmap(void *handle);
 
 namespace lua_transformer {
-std::vector<std::string> removeFiles;
+struct TransformResult {
+    std::string output;
+    std::vector<std::string> deps;    // Files other than the source itself that the output depends on
+    std::vector<std::string> envDeps; // Environment variables read by the `$comp_time` blocks through env_vars
+    bool cacheable = true;
+};
+
+// Bounded LRU cache of the transformed buffers, keyed by the content hash. Generated code is usually loaded many times with the same content.
+class StringCache {
+  public:
+    size_t capacity = 128; // Max number of entries, from LJP_STRING_CACHE_SIZE
+
+    const TransformResult *find(uint64_t key);
+    void insert(uint64_t key, const TransformResult &result);
+
+  private:
+    struct Entry {
+        uint64_t key;
+        TransformResult result;
+        std::vector<std::string> depHashes; // Hashes of result.deps when the entry was created
+        std::vector<std::string> envHashes; // Hashes of result.envDeps when the entry was created
+    };
+
+    std::list<Entry> entries_; // The most recently used entry first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+};
+
+class IncludeGraph;
+
+// All the mutable state of the transformer, the options are read from the environment when the context is created.
+// The interface functions use one context per thread, so VMs running on different threads can load luajit-pro code concurrently.
+struct TransformerContext {
+    LuaDoStringPtr luaDoString; // Used for generate compile time code
+
+    std::string cacheDir          = LJ_PRO_CACHE_DIR;
+    std::string proccessedSuffix  = ".1.proccessed";
+    std::string transformedSuffix = ".2.transformed";
+    std::vector<std::string> defines; // Extra macros for the preprocessor, from LJP_DEFINES
+    bool cacheEnabled         = true;
+    bool bytecodeCacheEnabled = false; // Opt-in by LJP_BC_CACHE, the bytecode is stored next to the transform cache
+    bool compTimeCacheEnabled = false; // Opt-in by LJP_COMPTIME_CACHE, memoize `$comp_time` blocks on disk(see CustomLuaTransformer::runCompTime())
+    bool keepFile             = false;
+    bool compact              = false; // Compact emission, from LJP_COMPACT, see compactCode()
+    std::string serverSocket;          // Transform server to ask first, from LJP_SERVER, see TransformServer
+    size_t streamSize   = 32 << 20;    // Files of this size or larger are streamed, from LJP_STREAM_SIZE(0 disables it), see TransformStream
+    size_t parallelSize = 8 << 20;     // Inputs of this size or larger are transformed in parallel, from LJP_PARALLEL_SIZE, see transformParallel()
+    size_t threads      = 1;           // Threads of the parallel transform, from LJP_THREADS(default: the number of cores up to 8, 1 disables it)
+    StringCache stringCache;
+    IncludeGraph *includeGraph = nullptr; // The include graph of the load in progress, see transformCode()
+
+    // The `$comp_time` blocks of all the files loaded by this thread share its Lua state, see CustomLuaTransformer::runCompTime()
+    uint64_t compTimeState = 0;                                         // Hash of the blocks run or memoized so far in load order, if memoized
+    std::vector<std::string> compTimeEnvDeps;                           // env_vars read by these blocks
+    std::vector<std::pair<std::string, std::string>> compTimePending; // Name and code of the memoized blocks which have not been run yet
+
+    explicit TransformerContext(LuaDoStringPtr func);
+};
+
+TransformResult transformFile(TransformerContext &ctx, const std::string &filename);
+TransformResult transformSource(TransformerContext &ctx, const std::string &filename, std::string_view source);
+TransformResult transformBuffer(TransformerContext &ctx, const std::string &name, std::string_view source);
+
+// An included file transformed and flattened onto a single line, so that the lines of the including file are kept
+struct IncludeNode {
+    std::string code;
+    TransformResult result; // Everything but the output
+    bool once = false;      // "include: once" in the directive line
+};
+
+// Per-load state of `$include`, shared by the transformers of a file and of all the files it includes. The modules are resolved natively
+// against package.path(read once per load) and memoized, every included file is transformed once and its code is reused by the later includes,
+// a file with "include: once" in its directive line is only expanded by its first include, and an include cycle is an error.
+class IncludeGraph {
+  public:
+    IncludeGraph(const std::string &rootFile, std::string_view rootSource);
+
+    // `package` is the Lua expression inside of `$include(...)`
+    std::string resolve(TransformerContext &ctx, const std::string &package, const std::string &codeName);
+    // Returns false if the file has already been included once
+    bool include(TransformerContext &ctx, const std::string &filename, IncludeNode &node);
+
+  private:
+    bool hasPackagePath_ = false;
+    std::string packagePath_;
+    std::unordered_map<std::string, std::string> resolved_; // Module name -> file
+    std::unordered_map<std::string, IncludeNode> nodes_;    // By absolute path, only the nodes which can be reused as is
+    std::unordered_set<std::string> included_;              // Absolute paths of the "include: once" files which have been expanded
+    std::vector<std::string> stack_;                        // Absolute paths of the files being expanded, the root file first
+};
+
+// Chrome trace(chrome://tracing, https://ui.perfetto.dev) of the load pipeline, enabled by LJP_TRACE=<file>("%p" in the path is replaced by the
+// process id). Unlike the transformer options, the trace belongs to the process: the spans of all threads go into one file, so it is guarded by
+// a mutex. Every span is written as soon as it ends, so the trace of a crashed boot can still be opened.
+class Tracer {
+  public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool enabled() const { return file_ != nullptr || sink_.load(std::memory_order_relaxed) != nullptr; }
+
+    static uint64_t now() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+    void span(const std::string &name, const std::string &file, size_t bytes, uint64_t start);
+
+    // The spans are also passed to the sink(e.g. luajit-pro-bench), it is called on the thread which ends the span
+    void setSink(TraceSinkPtr sink) { sink_.store(sink, std::memory_order_relaxed); }
+
+  private:
+    Tracer();
+    ~Tracer();
+
+    std::mutex mutex_;
+    FILE *file_ = nullptr;
+    std::atomic<TraceSinkPtr> sink_{nullptr};
+    int nextTid_ = 1;
+};
+
+// Emits a span from its construction to its destruction, `bytes` can be updated before the span ends. Costs a single branch if tracing is disabled.
+class TraceSpan {
+  public:
+    TraceSpan(const char *name, const std::string &file, size_t bytes = 0) : TraceSpan(std::string_view(name), file, bytes) {}
+    TraceSpan(std::string_view name, const std::string &file, size_t bytes = 0) : bytes(bytes), enabled_(Tracer::instance().enabled()) {
+        if (enabled_) {
+            name_  = name;
+            file_  = file;
+            start_ = Tracer::now();
+        }
+    }
+    ~TraceSpan() {
+        if (enabled_) {
+            Tracer::instance().span(name_, file_, bytes, start_);
+        }
+    }
+
+    TraceSpan(const TraceSpan &)            = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    size_t bytes;
+
+  private:
+    bool enabled_;
+    std::string name_;
+    std::string file_;
+    uint64_t start_ = 0;
+};
 
-LuaDoStringPtr luaDoString = nullptr; // Used for generate compile time code
+std::string flattenCode(std::string_view code);
+std::string compactCode(std::string_view code);
 
-enum class TokenKind {
+// Cross-run memoization of `$comp_time` blocks, see CustomLuaTransformer::runCompTime()
+std::string compTimeCacheFile(TransformerContext &ctx, const std::string &filename, const std::string &code);
+bool loadCompTime(const std::string &cacheFile, std::vector<std::string> &envDeps, std::string &output);
+void storeCompTime(const std::string &cacheFile, const std::vector<std::string> &envDeps, const std::string &output);
+
+enum class TokenKind : uint8_t {
     Identifier,
     Foreach,
     Map,
     Filter,
+    Find,
+    Any,
+    All,
+    Take,
+    First,
+    TakeWhile,
     ZipWithIndex,
     Return,
     Number,
     Symbol,
+    String,
     CompTime,
     Include,
     EndOfFile,
@@ -70,18 +276,111 @@ enum class FilterKind {
     ZipWithIndexFilter,
 };
 
+// A token as seen by the parser, materialized from the TokenTable on access
 struct Token {
     TokenKind kind;
-    std::string data;
+    std::string_view data; // Slice of the transformer input buffer(or a string literal for the default tokens)
 
     int idx; // Token index
     int startLine;
-    int startColumn;
-    int endLine;
-    int endColumn;
 
-    Token() : kind(TokenKind::Unknown), data(""), idx(0), startLine(0), startColumn(0), endLine(0), endColumn(0) {}
-    Token(TokenKind kind, const std::string &data, int startLine, int startColumn, int endLine, int endColumn) : kind(kind), data(data), idx(0 /* index is assigned in nextToken() */), startLine(startLine), startColumn(startColumn), endLine(endLine), endColumn(endColumn) {}
+    Token() : kind(TokenKind::Unknown), data(""), idx(0), startLine(0) {}
+    Token(TokenKind kind, std::string_view data, int idx, int startLine) : kind(kind), data(data), idx(idx), startLine(startLine) {}
+
+    std::string str() const { return std::string(data); }
+};
+
+// The tokens of a transformer input, stored column-wise: a token takes 17 bytes(kind, offset and size in the input, matching bracket, last
+// `return` of a bracket) and its text is a slice of the input. The line numbers are not stored per token, they are looked up in the offsets
+// of the line starts. The columns are sized for a token per 4 input bytes(Lua code has about one per 5 bytes) and doubled by realloc() when
+// they are full, which remaps the pages of a large column instead of copying them, so they only take the memory of the tokens there are.
+class TokenTable {
+  public:
+    TokenTable(std::pmr::memory_resource *arena, std::string_view content, int firstLine = 1) : content_(content), firstLine_(firstLine), lineStarts_(arena) {
+        ASSERT(content.size() < UINT32_MAX, "Input too large!");
+        reserve(content.size() / 4 + 64);
+    }
+    ~TokenTable() {
+        free(kinds_);
+        free(starts_);
+        free(sizes_);
+        free(matching_);
+        free(bodyReturn_);
+    }
+    TokenTable(const TokenTable &)            = delete;
+    TokenTable &operator=(const TokenTable &) = delete;
+
+    int size() const { return size_; }
+    Token operator[](int idx) const { return Token(kinds_[idx], content_.substr(starts_[idx], sizes_[idx]), idx, line(idx)); }
+    Token at(int idx) const {
+        ASSERT(idx >= 0 && idx < size_, "Token index out of range!");
+        return (*this)[idx];
+    }
+
+    // The columns are read directly by the parser, without building a Token
+    TokenKind kind(int idx) const {
+        ASSERT(idx >= 0 && idx < size_, "Token index out of range!");
+        return kinds_[idx];
+    }
+    std::string_view data(int idx) const {
+        ASSERT(idx >= 0 && idx < size_, "Token index out of range!");
+        return content_.substr(starts_[idx], sizes_[idx]);
+    }
+
+    // Token index of the matching bracket, -1 if the token is not a bracket
+    int32_t &matchingBracket(int idx) {
+        ASSERT(idx >= 0 && idx < size_, "Token index out of range!");
+        return matching_[idx];
+    }
+
+    // For a left bracket, the index of the last `return` directly inside it
+    int32_t &bodyReturn(int idx) {
+        ASSERT(idx >= 0 && idx < size_, "Token index out of range!");
+        return bodyReturn_[idx];
+    }
+
+    int push(TokenKind kind, std::string_view data) {
+        if (size_ == (int)capacity_) {
+            reserve(capacity_ * 2);
+        }
+        kinds_[size_]      = kind;
+        starts_[size_]     = (uint32_t)(data.data() - content_.data());
+        sizes_[size_]      = (uint32_t)data.size();
+        matching_[size_]   = -1;
+        bodyReturn_[size_] = -1;
+        return size_++;
+    }
+
+    // Record that a line starts at `offset`, called by the lexer for every newline in order
+    void lineStart(size_t offset) { lineStarts_.push_back((uint32_t)offset); }
+    int currentLine() const { return (int)lineStarts_.size() + firstLine_; }
+    int line(int idx) const { return (int)(std::upper_bound(lineStarts_.begin(), lineStarts_.end(), starts_[idx]) - lineStarts_.begin()) + firstLine_; }
+
+  private:
+    std::string_view content_;
+    size_t capacity_ = 0;
+    int firstLine_; // Line number of the start of the input, which is a window of the source in the streaming transform
+    int size_ = 0;
+    TokenKind *kinds_    = nullptr;
+    uint32_t *starts_    = nullptr;
+    uint32_t *sizes_     = nullptr;
+    int32_t *matching_   = nullptr;
+    int32_t *bodyReturn_ = nullptr;
+    std::pmr::vector<uint32_t> lineStarts_;
+
+    template <typename T> void grow(T *&column, size_t capacity) {
+        auto grown = (T *)realloc(column, capacity * sizeof(T));
+        ASSERT(grown != nullptr, "Out of memory!");
+        column = grown;
+    }
+    void reserve(size_t capacity) {
+        grow(kinds_, capacity);
+        grow(starts_, capacity);
+        grow(sizes_, capacity);
+        grow(matching_, capacity);
+        grow(bodyReturn_, capacity);
+        capacity_ = capacity;
+    }
 };
 
 std::string toString(TokenKind kind) {
@@ -94,6 +393,18 @@ std::string toString(TokenKind kind) {
         return "Map";
     case TokenKind::Filter:
         return "Filter";
+    case TokenKind::Find:
+        return "Find";
+    case TokenKind::Any:
+        return "Any";
+    case TokenKind::All:
+        return "All";
+    case TokenKind::Take:
+        return "Take";
+    case TokenKind::First:
+        return "First";
+    case TokenKind::TakeWhile:
+        return "TakeWhile";
     case TokenKind::ZipWithIndex:
         return "ZipWithIndex";
     case TokenKind::Return:
@@ -102,6 +413,8 @@ std::string toString(TokenKind kind) {
         return "Number";
     case TokenKind::Symbol:
         return "Symbol";
+    case TokenKind::String:
+        return "String";
     case TokenKind::CompTime:
         return "CompTime";
     case TokenKind::Include:
@@ -115,225 +428,334 @@ std::string toString(TokenKind kind) {
     }
 }
 
+// `find`, `any`, `all`, `take`, `first` and `takeWhile` stop the loop as soon as their result is known
+static bool isShortCircuit(TokenKind kind) {
+    return kind == TokenKind::Find || kind == TokenKind::Any || kind == TokenKind::All || kind == TokenKind::Take || kind == TokenKind::First || kind == TokenKind::TakeWhile;
+}
+
+static bool isOperator(TokenKind kind) { return kind == TokenKind::Foreach || kind == TokenKind::Map || kind == TokenKind::Filter || isShortCircuit(kind); }
+
+// The operator names are only keywords in an operator site, anywhere else they are plain names, e.g. `local first = all.map{...}`
+static bool isName(TokenKind kind) { return kind == TokenKind::Identifier || isOperator(kind); }
+
+// A rewrite of the transformer input: the bytes [start, end) of the input buffer are replaced by `text`(allocated from the transformer arena)
+struct Edit {
+    uint32_t start;
+    uint32_t end;
+    std::string_view text;
+};
+
+// One operator of a chain like `tbl.map{...}.filter{...}.foreach{...}`
+struct ChainStage {
+    TokenKind kind;
+    bool simple = false; // `op{func}`
+    bool zipWithIndex = false;
+    Token refToken;
+    Token idxToken;
+    Token funcToken;
+    Token bodyStartToken;
+    Token returnToken;
+    Token rightBracketToken;
+};
+
+// What a window of the streaming transform passes on to the transformer of the next window, see TransformStream
+struct WindowState {
+    int firstLine     = 1; // Set by the stream, the tokenizer does not run on the windows without extended syntax
+    bool denseArrays  = false;
+    bool compact      = false;
+    bool pendingDense = false; // The window ends with a `--[[dense]]` annotation, it applies to the first statement of the next one
+    std::vector<std::string> envDeps;
+};
+
 class CustomLuaTransformer {
   public:
-    std::vector<std::string> oldContentLines;
-
-    explicit CustomLuaTransformer(const std::string &filename);
+    CustomLuaTransformer(TransformerContext &ctx, const std::string &filename, std::string_view content); // `content` must outlive the transformer
+    // Continues the transform of a file on its next window, which does not have the directive line
+    CustomLuaTransformer(TransformerContext &ctx, const std::string &filename, std::string_view content, WindowState &&state);
     void tokenize();
     void parse(int idx);
+    std::string output();
     void dumpContentLines(bool hasLineNumbers);
+    WindowState takeWindowState(); // After parse(), the transformer can not be used any more
+    // The options set by the directive line of a file, which the windows after the first one do not have
+    static WindowState directiveState(TransformerContext &ctx, std::string_view firstLine);
+
+    std::vector<std::string> includeDeps; // Files pulled in by `$include`, including their own dependencies
+    std::vector<std::string> envDeps;     // env_vars read by the `$comp_time` blocks of this file and of the `$include`d files
+    bool hasCompTime = false;             // `$comp_time` may read anything(e.g. a file or the time), so its output is never cached
+    bool compact     = false;             // LJP_COMPACT or "emit: compact" in the directive line
 
   private:
-    bool isFirstToken = true;
-    std::istream *stream_;
-    std::ifstream fstream_;
+    TransformerContext &ctx_;
     std::string filename_;
+    std::string_view content_;
+
+    // Everything which scales with the size of the input is allocated from the arena, and released at once with the transformer
+    std::pmr::monotonic_buffer_resource arena_;
+
+    // The lexer scans the input buffer with a cursor, tokens are slices of the buffer
+    const char *cur_;
+    const char *end_;
 
-    std::vector<Token> tokenVec;
-    std::unordered_set<int> processedTokenLines;
-    std::unordered_set<int> processedTokenColumns;
-    std::unordered_set<int> replacedTokenLines;
-    std::unordered_set<int> replacedTokenColumns;
-    int tokenVecIdx = 0;
+    TokenTable tokenTable;
 
-    std::vector<int> bracketStack;
+    // Built during tokenization so that the parser never has to scan for a closing bracket, see TokenTable::matchingBracket()/bodyReturn()
+    std::pmr::vector<int> bracketStack;
+    std::pmr::vector<int> returnStack; // The last `return` directly inside each open bracket
 
-    int currentLine_   = 1;
-    int currentColumn_ = 0;
+    // The parser never touches the input, it only records edits which are applied by output() in a single pass
+    std::pmr::vector<Edit> edits_;
 
+    // Dense array mode: "array: dense" in the directive line for the whole file, or a `--[[dense]]` annotation for the next operator site
+    bool denseArrays_ = false;
+    std::pmr::vector<int> denseAnnotations_; // Index of the token following each annotation
+    size_t nextAnnotation_ = 0;              // The first annotation which has not been bound to a site or dropped yet
+    std::unordered_set<int> denseSites_;
+
+    void advanceTo(const char *to);
+    int longBracketLevel(const char *p) const;
+    const char *skipLongBracket(const char *p, int level) const;
     Token _nextToken();
     Token nextToken();
 
-    std::string getContentBetween(Token &startToken, Token &endToken);
-    void replaceContentBetween(int line, Token &startToken, Token &endToken, std::string content);
-    void replaceContent(int line, std::string content);
+    size_t startOffset(const Token &token) const { return token.data.data() - content_.data(); }
+    size_t endOffset(const Token &token) const { return startOffset(token) + token.data.size(); }
+    std::string_view getContentBetween(const Token &startToken, const Token &endToken) const;
+    void replace(size_t start, size_t end, std::string text);
+    void replaceToken(const Token &token, std::string text) { replace(startOffset(token), endOffset(token), std::move(text)); }
+    std::string loopHeader(int opIdx, const std::string &idx, const std::string &ref, const std::string &tbl) const;
+
+    int siteLeftBracket(int idx);
+    int findRightBracket(int leftIdx, std::string_view left);
 
     void parseForeach(int idx);
     void parseMap(int idx);
     void parseFilter(int idx);
+    std::vector<int> chainOperators(int idx);
+    ChainStage chainStage(int idx);
+    void parseChain(const std::vector<int> &ops);
     void parseCompTime(int idx);
+    std::string runCompTime(const std::string &codeName, const std::string &code);
+    void addEnvDep(const std::string &name);
     void parseInclude(int idx);
 };
 
-CustomLuaTransformer::CustomLuaTransformer(const std::string &filename) : filename_(filename) {
-    fstream_ = std::ifstream(filename);
-    if (!std::filesystem::exists(filename)) {
-        std::cout << "[CustomLuaTransformer] file does not exist:" << filename << std::endl;
-        ASSERT(false);
-    }
-    stream_ = &fstream_;
-
-    std::ifstream file(filename);
-    std::string line;
+static bool isWordChar(char c) { return std::isalnum((unsigned char)c) || c == '_'; }
 
-    if (!file.is_open()) {
-        std::cout << "[CustomLuaTransformer] Unable to open " << filename << std::endl;
-        ASSERT(false);
+// Returns the value word of a "<name>: <value>" option in the directive line, e.g. "--[[luajit-pro]] preprocess: false array: dense"
+static std::string_view directiveOption(std::string_view firstLine, std::string_view name) {
+    auto option = firstLine.find(name);
+    while (option != std::string_view::npos && firstLine.substr(option + name.size(), 1) != ":") {
+        option = firstLine.find(name, option + 1);
     }
-
-    while (std::getline(file, line)) {
-        oldContentLines.push_back(line);
+    if (option == std::string_view::npos) {
+        return {};
     }
+    auto value = firstLine.substr(option + name.size() + 1);
+    value.remove_prefix(std::min(value.find_first_not_of(" \t\r"), value.size()));
+    size_t size = 0;
+    while (size < value.size() && isWordChar(value[size])) {
+        size++;
+    }
+    return value.substr(0, size);
+}
 
-    if (oldContentLines[0].find(std::string("--[[luajit-pro]]")) == std::string::npos) {
+CustomLuaTransformer::CustomLuaTransformer(TransformerContext &ctx, const std::string &filename, std::string_view content) : ctx_(ctx), filename_(filename), content_(content), cur_(content.data()), end_(content.data() + content.size()), tokenTable(&arena_, content), bracketStack(&arena_), returnStack(&arena_), edits_(&arena_), denseAnnotations_(&arena_) {
+    auto firstLineEnd = std::min(content.find('\n'), content.size());
+    if (content.substr(0, firstLineEnd).find("--[[luajit-pro]]") == std::string_view::npos) {
         std::cout << "[CustomLuaTransformer] File does not contain verilua comment in first line: " << filename << std::endl;
         assert(0);
     } else {
-        oldContentLines[0] = "--[[luajit-pro]] local ipairs, _tinsert = ipairs, table.insert";
+        auto state   = directiveState(ctx, content.substr(0, firstLineEnd));
+        denseArrays_ = state.denseArrays;
+        compact      = state.compact;
+        replace(0, firstLineEnd, "--[[luajit-pro]] local ipairs, _tnew = ipairs, require(\"table.new\")");
     }
+}
 
-    file.close();
+CustomLuaTransformer::CustomLuaTransformer(TransformerContext &ctx, const std::string &filename, std::string_view content, WindowState &&state)
+    : compact(state.compact), ctx_(ctx), filename_(filename), content_(content), cur_(content.data()), end_(content.data() + content.size()), tokenTable(&arena_, content, state.firstLine), bracketStack(&arena_), returnStack(&arena_), edits_(&arena_), denseArrays_(state.denseArrays), denseAnnotations_(&arena_) {
+    envDeps = std::move(state.envDeps);
+    if (state.pendingDense) {
+        denseAnnotations_.push_back(0);
+    }
 }
 
-Token CustomLuaTransformer::_nextToken() {
-    auto &stream = *stream_;
+WindowState CustomLuaTransformer::directiveState(TransformerContext &ctx, std::string_view firstLine) {
+    WindowState state;
+    state.denseArrays = directiveOption(firstLine, "array") == "dense";
+    state.compact     = ctx.compact || directiveOption(firstLine, "emit") == "compact";
+    return state;
+}
 
-    if (stream.bad())
-        return Token(TokenKind::EndOfFile, "", currentLine_, currentColumn_, currentLine_, currentColumn_);
+WindowState CustomLuaTransformer::takeWindowState() {
+    WindowState state;
+    state.denseArrays    = denseArrays_;
+    state.compact        = compact;
+    state.pendingDense   = !denseAnnotations_.empty() && tokenTable.kind(denseAnnotations_.back()) == TokenKind::EndOfFile;
+    state.envDeps        = std::move(envDeps);
+    return state;
+}
 
-    std::stringstream result;
-    char c;
-    int startLine   = currentLine_;
-    int startColumn = currentColumn_;
+// Move the cursor to `to`, keeping track of the line numbers of the skipped text
+void CustomLuaTransformer::advanceTo(const char *to) {
+    const char *p = cur_;
+    while ((p = (const char *)memchr(p, '\n', to - p)) != nullptr) {
+        tokenTable.lineStart(++p - content_.data());
+    }
+    cur_ = to;
+}
 
-    // Skip whitespace and update position
-    while (stream.get(c) && std::isspace(c)) {
-        if (c == '\n') {
-            currentLine_++;
-            currentColumn_ = 0;
-        } else {
-            currentColumn_++;
-        }
-    }
-
-    if (stream.eof())
-        return Token(TokenKind::EndOfFile, "", startLine, startColumn, currentLine_, currentColumn_);
-
-    startLine   = currentLine_;
-    startColumn = currentColumn_;
-
-    // Handle comments
-    if (c == '-') {
-        if (stream.peek() == '-') {
-            stream.get(c); // consume second '-'
-            // Check for long comment
-            if (stream.peek() == '[') {
-                stream.get(c); // consume '['
-                if (stream.peek() == '[') {
-                    // Long comment
-                    stream.get(c); // consume second '['
-                    while (stream.get(c)) {
-                        if (c == ']' && stream.peek() == ']') {
-                            stream.get(c); // consume closing ']'
-                            break;
-                        }
-                        if (c == '\n') {
-                            currentLine_++;
-                            currentColumn_ = 0;
-                        }
-                    }
-                    return _nextToken();
-                } else {
-                    // Single-line comment
-                    while (stream.get(c) && c != '\n')
-                        ;
-                    currentLine_++;
-                    currentColumn_ = 0;
-                    return _nextToken();
-                }
-            } else {
-                // Single-line comment
-                while (stream.get(c) && c != '\n')
-                    ;
-                currentLine_++;
-                currentColumn_ = 0;
-                return _nextToken();
-            }
-        }
-    }
-
-    // Handle numbers
-    if (std::isdigit(c)) {
-        result << c;
-        currentColumn_++;
-        while (stream.get(c) && std::isdigit(c)) {
-            result << c;
-            currentColumn_++;
-        }
-        stream.unget();
-        return Token(TokenKind::Number, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-    }
-
-    // Handle identifiers and keywords
-    if (std::isalpha(c) || c == '_') {
-        result << c;
-        currentColumn_++;
-        while (stream.get(c) && (std::isalnum(c) || c == '_')) {
-            result << c;
-            currentColumn_++;
-        }
-        stream.unget();
-
-        if (result.str() == "foreach") {
-            return Token(TokenKind::Foreach, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else if (result.str() == "map") {
-            return Token(TokenKind::Map, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else if (result.str() == "filter") {
-            return Token(TokenKind::Filter, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else if (result.str() == "return") {
-            return Token(TokenKind::Return, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else if (result.str() == "zipWithIndex") {
-            return Token(TokenKind::ZipWithIndex, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else {
-            return Token(TokenKind::Identifier, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        }
+// Returns the level(number of `=`) of the Lua long bracket starting at `p`, or -1 if there is none
+int CustomLuaTransformer::longBracketLevel(const char *p) const {
+    if (p >= end_ || *p != '[') {
+        return -1;
     }
+    const char *q = p + 1;
+    while (q < end_ && *q == '=') {
+        q++;
+    }
+    return (q < end_ && *q == '[') ? (int)(q - p - 1) : -1;
+}
 
-    // Handle $ identifiers
-    if (c == '$') {
-        result << c;
-        currentColumn_++;
-        while (stream.get(c) && (std::isalnum(c) || c == '_')) {
-            result << c;
-            currentColumn_++;
+// Returns the position after the closing long bracket of the given level, or the end of the buffer
+const char *CustomLuaTransformer::skipLongBracket(const char *p, int level) const {
+    p += level + 2;
+    while (p < end_) {
+        p = (const char *)memchr(p, ']', end_ - p);
+        if (p == nullptr) {
+            return end_;
         }
-        stream.unget(); // Put back the last character
+        const char *q = p + 1;
+        while (q < end_ && *q == '=') {
+            q++;
+        }
+        if (q < end_ && *q == ']' && q - p - 1 == level) {
+            return q + 1;
+        }
+        p++;
+    }
+    return end_;
+}
 
-        // Check if the token is $comp_time
-        if (result.str() == "$comp_time") {
-            return Token(TokenKind::CompTime, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else if (result.str() == "$include") {
-            return Token(TokenKind::Include, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-        } else {
-            return Token(TokenKind::Symbol, result.str(), startLine, startColumn, currentLine_, currentColumn_);
+static TokenKind keywordKind(std::string_view word) {
+    switch (word.size()) {
+    case 3:
+        return word == "map" ? TokenKind::Map : (word == "any" ? TokenKind::Any : (word == "all" ? TokenKind::All : TokenKind::Identifier));
+    case 4:
+        return word == "find" ? TokenKind::Find : (word == "take" ? TokenKind::Take : TokenKind::Identifier);
+    case 5:
+        return word == "first" ? TokenKind::First : TokenKind::Identifier;
+    case 6:
+        return word == "filter" ? TokenKind::Filter : (word == "return" ? TokenKind::Return : TokenKind::Identifier);
+    case 7:
+        return word == "foreach" ? TokenKind::Foreach : TokenKind::Identifier;
+    case 9:
+        return word == "takeWhile" ? TokenKind::TakeWhile : TokenKind::Identifier;
+    case 12:
+        return word == "zipWithIndex" ? TokenKind::ZipWithIndex : TokenKind::Identifier;
+    default:
+        return TokenKind::Identifier;
+    }
+}
+
+Token CustomLuaTransformer::_nextToken() {
+    // Skip whitespace and comments
+    while (true) {
+        const char *p = cur_;
+        while (p < end_ && std::isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (p + 1 < end_ && p[0] == '-' && p[1] == '-') {
+            int level = longBracketLevel(p + 2);
+            if (level >= 0) {
+                if (std::string_view(p, end_ - p).substr(0, 11) == "--[[dense]]") {
+                    denseAnnotations_.push_back(tokenTable.size());
+                }
+                p = skipLongBracket(p + 2, level);
+            } else {
+                p = (const char *)memchr(p, '\n', end_ - p);
+                p = p == nullptr ? end_ : p;
+            }
+        } else if (p == cur_) {
+            break;
         }
+        advanceTo(p);
     }
 
-    // Handle symbols
-    result << c;
-    currentColumn_++;
-    if (c == '=' && stream.peek() == '=') {
-        stream.get(c);
-        result << c;
-        currentColumn_++;
+    if (cur_ >= end_) {
+        return Token(TokenKind::EndOfFile, std::string_view(end_, 0), 0, tokenTable.currentLine());
     }
 
-    return Token(TokenKind::Symbol, result.str(), startLine, startColumn, currentLine_, currentColumn_);
-}
+    const char *start = cur_;
+    const char *p     = cur_;
+    TokenKind kind    = TokenKind::Symbol;
+    char c            = *p;
 
-Token CustomLuaTransformer::nextToken() {
-    if (isFirstToken) {
-        isFirstToken = false;
+    if (c == '"' || c == '\'') {
+        // Short strings are skipped in one step, so keywords inside them are never seen by the parser
+        p++;
+        while (p < end_ && *p != c && *p != '\n') {
+            p += (*p == '\\' && p + 1 < end_) ? 2 : 1;
+        }
+        p    = p < end_ && *p == c ? p + 1 : p;
+        kind = TokenKind::String;
+    } else if (c == '[' && longBracketLevel(p) >= 0) {
+        p    = skipLongBracket(p, longBracketLevel(p));
+        kind = TokenKind::String;
+    } else if (std::isdigit((unsigned char)c)) {
+        // Also covers hexadecimal numbers, fractions and exponents, e.g. `0x1F`, `1.5e-3`
+        p++;
+        while (p < end_ && (isWordChar(*p) || *p == '.' || ((*p == '+' || *p == '-') && std::strchr("eEpP", p[-1])))) {
+            p++;
+        }
+        kind = TokenKind::Number;
+    } else if (std::isalpha((unsigned char)c) || c == '_') {
+        while (p < end_ && isWordChar(*p)) {
+            p++;
+        }
+        kind = keywordKind(std::string_view(start, p - start));
+    } else if (c == '$') {
+        p++;
+        while (p < end_ && isWordChar(*p)) {
+            p++;
+        }
+        std::string_view word(start, p - start);
+        if (word == "$comp_time") {
+            kind = TokenKind::CompTime;
+        } else if (word == "$include") {
+            kind = TokenKind::Include;
+        }
     } else {
-        tokenVecIdx++;
+        p += (c == '=' && p + 1 < end_ && p[1] == '=') ? 2 : 1;
     }
 
-    auto token = _nextToken();
-    token.idx  = tokenVecIdx;
-    // fmt::println("[{:3}] | {:>8} | {:>15} | {:5} | {:5} |", tokenVecIdx, token.data, toString(token.kind), token.startLine, token.startColumn);
+    int startLine = tokenTable.currentLine();
+    advanceTo(p);
+    return Token(kind, std::string_view(start, p - start), 0 /* index is assigned in nextToken() */, startLine);
+}
 
-    tokenVec.emplace_back(token);
+Token CustomLuaTransformer::nextToken() {
+    auto token = _nextToken();
+    token.idx  = tokenTable.push(token.kind, token.data);
+    // fmt::println("[{:3}] | {:>8} | {:>15} | {:5} |", token.idx, token.data, toString(token.kind), token.startLine);
+
+    if (token.kind == TokenKind::Symbol && token.data.size() == 1) {
+        char c = token.data[0];
+        if (c == '{' || c == '(' || c == '[') {
+            bracketStack.push_back(token.idx);
+            returnStack.push_back(-1);
+        } else if ((c == '}' || c == ')' || c == ']') && !bracketStack.empty()) {
+            int leftIdx                           = bracketStack.back();
+            tokenTable.matchingBracket(leftIdx)   = token.idx;
+            tokenTable.matchingBracket(token.idx) = leftIdx;
+            tokenTable.bodyReturn(leftIdx)        = returnStack.back();
+            bracketStack.pop_back();
+            returnStack.pop_back();
+        }
+    } else if (token.kind == TokenKind::Return && !returnStack.empty()) {
+        returnStack.back() = token.idx;
+    }
 
     return token;
 }
@@ -346,37 +768,108 @@ void CustomLuaTransformer::tokenize() {
     }
 }
 
-std::string CustomLuaTransformer::getContentBetween(Token &startToken, Token &endToken) {
-    std::string content;
-    if (startToken.startLine == endToken.startLine) {
-        content += oldContentLines[startToken.startLine - 1].substr(startToken.endColumn, endToken.startColumn - startToken.endColumn);
-    } else {
-        for (int i = startToken.startLine; i <= endToken.startLine; i++) {
-            if (i == startToken.startLine) {
-                content += oldContentLines[i - 1].substr(startToken.endColumn);
-                content += "\n";
-            } else if (i == endToken.startLine) {
-                content += oldContentLines[i - 1].substr(0, endToken.startColumn);
-                content += "\n";
-            } else {
-                content += oldContentLines[i - 1];
-                content += "\n";
-            }
+std::string_view CustomLuaTransformer::getContentBetween(const Token &startToken, const Token &endToken) const {
+    return content_.substr(endOffset(startToken), startOffset(endToken) - endOffset(startToken));
+}
+
+// Record that the input bytes [start, end) are replaced by `text`. The lines removed by a multi-line replacement are kept as `--[[line keeper]]`
+// and the last one is padded to its original column, so the code after the replacement stays on its original line.
+void CustomLuaTransformer::replace(size_t start, size_t end, std::string text) {
+    auto removed     = content_.substr(start, end - start);
+    auto lastNewline = removed.rfind('\n');
+    if (lastNewline != std::string_view::npos) {
+        auto lines = std::count(removed.begin(), removed.end(), '\n');
+        for (int i = 1; i < lines; i++) {
+            text += "\n--[[line keeper]]";
         }
+        text += '\n';
+        text.append(removed.size() - lastNewline - 1, ' ');
     }
-    return content;
+    char *copy = (char *)arena_.allocate(text.size(), 1);
+    memcpy(copy, text.data(), text.size());
+    edits_.push_back(Edit{(uint32_t)start, (uint32_t)end, std::string_view(copy, text.size())});
 }
 
-void CustomLuaTransformer::parseForeach(int idx) {
-    int bracketCnt = 0;
-    int _idx       = idx;
+// Apply the recorded edits to the input, the output is assembled in one pass into a buffer of the exact size
+std::string CustomLuaTransformer::output() {
+    std::sort(edits_.begin(), edits_.end(), [](const Edit &a, const Edit &b) { return a.start < b.start; });
 
-    while (tokenVec.at(_idx).kind != TokenKind::Foreach) {
-        _idx++;
-        if (tokenVec.at(_idx).kind == TokenKind::EndOfFile) {
-            return;
+    size_t outputSize = content_.size();
+    for (const auto &edit : edits_) {
+        outputSize += edit.text.size() - (edit.end - edit.start);
+    }
+
+    std::string result;
+    result.reserve(outputSize);
+    size_t pos = 0;
+    for (const auto &edit : edits_) {
+        ASSERT(edit.start >= pos, "Overlapping edits!");
+        result.append(content_.substr(pos, edit.start - pos));
+        result.append(edit.text);
+        pos = edit.end;
+    }
+    result.append(content_.substr(pos));
+    return result;
+}
+
+// The loop over `tbl` of the operator site at `opIdx`. A dense array is walked with a numeric loop up to its length(evaluated once), which
+// compiles to a tighter trace than the `ipairs` iterator but does not stop at the first `nil`.
+std::string CustomLuaTransformer::loopHeader(int opIdx, const std::string &idx, const std::string &ref, const std::string &tbl) const {
+    if (denseArrays_ || denseSites_.count(opIdx)) {
+        return "for " + idx + " = 1, #" + tbl + " do local " + ref + " = " + tbl + "[" + idx + "] ";
+    }
+    return "for " + idx + ", " + ref + " in ipairs(" + tbl + ") do ";
+}
+
+// Returns the index of the left bracket if the operator token at `idx` starts an operator site, e.g. `tbl.foreach{`, `tbl.foreach.zipWithIndex{`, `$comp_time(name) {`, `$include(`.
+// Returns -1 otherwise, so identifiers like `local map = {}` or `x:filter(y)` are left untouched.
+int CustomLuaTransformer::siteLeftBracket(int idx) {
+    auto isSymbol = [&](int i, const char *data) { return i >= 0 && i < (int)tokenTable.size() && tokenTable.kind(i) == TokenKind::Symbol && tokenTable.data(i) == data; };
+
+    switch (tokenTable.kind(idx)) {
+    case TokenKind::Foreach:
+    case TokenKind::Map:
+    case TokenKind::Filter:
+    case TokenKind::Find:
+    case TokenKind::Any:
+    case TokenKind::All:
+    case TokenKind::Take:
+    case TokenKind::First:
+    case TokenKind::TakeWhile:
+        if (!isSymbol(idx - 1, ".")) {
+            return -1;
+        }
+        if (isSymbol(idx + 1, "{")) {
+            return idx + 1;
+        }
+        if (isSymbol(idx + 1, ".") && tokenTable.kind(idx + 2) == TokenKind::ZipWithIndex && isSymbol(idx + 3, "{")) {
+            return idx + 3;
         }
+        return -1;
+    case TokenKind::CompTime:
+        if (isSymbol(idx + 1, "(") && isSymbol(idx + 3, ")") && isSymbol(idx + 4, "{")) {
+            return idx + 4;
+        }
+        return isSymbol(idx + 1, "{") ? idx + 1 : -1;
+    case TokenKind::Include:
+        return isSymbol(idx + 1, "(") ? idx + 1 : -1;
+    default:
+        return -1;
     }
+}
+
+int CustomLuaTransformer::findRightBracket(int leftIdx, std::string_view left) {
+    ASSERT(tokenTable.data(leftIdx) == left);
+    int rightIdx = tokenTable.matchingBracket(leftIdx);
+    if (rightIdx < 0) {
+        std::cerr << "[CustomLuaTransformer] " << filename_ << ":" << tokenTable.at(leftIdx).startLine << ": unmatched '" << left << "'" << std::endl;
+        ASSERT(false, "Unmatched bracket!");
+    }
+    return rightIdx;
+}
+
+void CustomLuaTransformer::parseForeach(int idx) {
+    int _idx = idx;
 
     ForeachKind foreachKind;
     Token tblToken;
@@ -389,127 +882,66 @@ void CustomLuaTransformer::parseForeach(int idx) {
     refToken.data = "ref";
     idxToken.data = "_";
 
-    if (tokenVec.at(_idx - 2).kind == TokenKind::Identifier) {
-        if (tokenVec.at(_idx + 2).kind == TokenKind::ZipWithIndex)
+    if (isName(tokenTable.kind(_idx - 2))) {
+        if (tokenTable.kind(_idx + 2) == TokenKind::ZipWithIndex)
             foreachKind = ForeachKind::ForeachZipWithIndex;
-        else if (tokenVec.at(_idx + 2).kind == TokenKind::Identifier && tokenVec.at(_idx + 3).kind == TokenKind::Symbol && tokenVec.at(_idx + 3).data == "}")
+        else if (isName(tokenTable.kind(_idx + 2)) && tokenTable.kind(_idx + 3) == TokenKind::Symbol && tokenTable.data(_idx + 3) == "}")
             foreachKind = ForeachKind::ForeachSimple;
         else
             foreachKind = ForeachKind::Foreach;
-    } else if (tokenVec.at(_idx - 2).kind == TokenKind::ZipWithIndex) {
+    } else if (tokenTable.kind(_idx - 2) == TokenKind::ZipWithIndex) {
         foreachKind = ForeachKind::ZipWithIndexForeach;
     } else {
-        // fmt::println("Unexpected token at line => {} column => {}", tokenVec.at(_idx).startLine, tokenVec.at(_idx).startColumn);
+        // fmt::println("Unexpected token at line => {}", tokenTable.at(_idx).startLine);
         ASSERT(false);
     }
 
     switch (foreachKind) {
     case ForeachKind::Foreach:
         // <tblToken>.foreach <leftBracketToken> <refToken> => <bodyStartToken> ... <rightBracketToken>
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 2);
-        bodyStartToken = tokenVec.at(_idx + 5);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 2);
+        bodyStartToken = tokenTable.at(_idx + 5);
         _idx++;
         break;
     case ForeachKind::ForeachSimple:
         // <tblToken>.foreach <leftBracketToken> <funcToken> <rightBracketToken>
-        tblToken       = tokenVec.at(_idx - 2);
-        funcToken      = tokenVec.at(_idx + 2);
+        tblToken       = tokenTable.at(_idx - 2);
+        funcToken      = tokenTable.at(_idx + 2);
         bodyStartToken = funcToken;
         _idx++;
         break;
     case ForeachKind::ForeachZipWithIndex:
         // <tblToken>.foreach.zipWithIndex <leftBracketToken> (<refToken>, <idxToken>) => <bodyStartToken> ... <rightBracketToken>
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 7);
-        bodyStartToken = tokenVec.at(_idx + 11);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 7);
+        bodyStartToken = tokenTable.at(_idx + 11);
         _idx += 3;
         break;
     case ForeachKind::ZipWithIndexForeach:
         // <tblToken>.zipWithIndex.foreach <leftBracketToken> (<idxToken>, <refToken>) => <bodyStartToken> ... <rightBracketToken>
-        tblToken       = tokenVec.at(_idx - 4);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 3);
-        bodyStartToken = tokenVec.at(_idx + 9);
+        tblToken       = tokenTable.at(_idx - 4);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 3);
+        bodyStartToken = tokenTable.at(_idx + 9);
         _idx++;
         break;
     default:
         ASSERT(false);
     }
 
-    if (processedTokenLines.count(tblToken.startLine) > 0 && processedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
-    }
-
-    tblToken.data = tblToken.data;
-
-    auto token      = tokenVec.at(_idx);
-    auto startToken = token;
-    ASSERT(token.data == "{");
-
-    while (token.data == "{" || bracketCnt != 0) {
-        if (token.data == "}") {
-            bracketCnt--;
-            if (bracketCnt == 0) {
-                break;
-            }
-        } else if (token.data == "{") {
-            bracketCnt++;
-            parse(_idx + 1);
-        }
-
-        _idx++;
-        token = tokenVec.at(_idx);
-    }
-    rightBracketToken = token; // The final matched token is right bracket
-
-    processedTokenLines.insert(tblToken.startLine);
-    processedTokenColumns.insert(tblToken.startColumn);
-
-    // If the tblToken has been replaced, don't replace it again
-    if (replacedTokenLines.count(tblToken.startLine) > 0 && replacedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
-    } else {
-        replacedTokenLines.insert(tblToken.startLine);
-        replacedTokenColumns.insert(tblToken.startColumn);
-    }
-
-    if (tblToken.startLine == bodyStartToken.startLine) {
-        oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, "end");
-        if (foreachKind == ForeachKind::ForeachSimple) {
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, funcToken.data + "(" + refToken.data + ") ");
-            oldContentLines[tblToken.startLine - 1].replace(tblToken.startColumn, bodyStartToken.startColumn - tblToken.startColumn, "for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ");
-        } else {
-            oldContentLines[tblToken.startLine - 1].replace(tblToken.startColumn, bodyStartToken.startColumn - tblToken.startColumn, "for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ");
-        }
-    } else {
-        oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, "end");
-        if (foreachKind == ForeachKind::ForeachSimple) {
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, funcToken.data + "(" + refToken.data + ") ");
-        }
-        oldContentLines[tblToken.startLine - 1] = "for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ";
+    rightBracketToken = tokenTable.at(findRightBracket(_idx, "{"));
 
-        for (int i = tblToken.startLine + 1; i <= bodyStartToken.startLine; i++) {
-            if (i == bodyStartToken.startLine) {
-                oldContentLines[i - 1].replace(0, bodyStartToken.startColumn, std::string(bodyStartToken.startColumn, ' '));
-            } else {
-                oldContentLines[i - 1] = "--[[line keeper]]";
-            }
-        }
+    replaceToken(rightBracketToken, "end");
+    if (foreachKind == ForeachKind::ForeachSimple) {
+        replaceToken(funcToken, funcToken.str() + "(" + refToken.str() + ") ");
     }
+    replace(startOffset(tblToken), startOffset(bodyStartToken), loopHeader(idx, idxToken.str(), refToken.str(), tblToken.str()));
 }
 
 void CustomLuaTransformer::parseMap(int idx) {
-    int bracketCnt = 0;
-    int _idx       = idx;
-
-    while (tokenVec.at(_idx).kind != TokenKind::Map) {
-        _idx++;
-        if (tokenVec.at(_idx).kind == TokenKind::EndOfFile) {
-            return;
-        }
-    }
+    int _idx = idx;
 
     MapKind mapKind;
     Token retToken;
@@ -524,142 +956,83 @@ void CustomLuaTransformer::parseMap(int idx) {
     refToken.data = "ref";
     idxToken.data = "_";
 
-    if (tokenVec.at(_idx - 2).kind == TokenKind::Identifier) {
-        if (tokenVec.at(_idx + 2).kind == TokenKind::ZipWithIndex)
+    if (isName(tokenTable.kind(_idx - 2))) {
+        if (tokenTable.kind(_idx + 2) == TokenKind::ZipWithIndex)
             mapKind = MapKind::MapZipWithIndex;
-        else if (tokenVec.at(_idx + 2).kind == TokenKind::Identifier && tokenVec.at(_idx + 3).data == "}")
+        else if (isName(tokenTable.kind(_idx + 2)) && tokenTable.data(_idx + 3) == "}")
             mapKind = MapKind::MapSimple;
         else
             mapKind = MapKind::Map;
-    } else if (tokenVec.at(_idx - 2).kind == TokenKind::ZipWithIndex) {
+    } else if (tokenTable.kind(_idx - 2) == TokenKind::ZipWithIndex) {
         mapKind = MapKind::ZipWithIndexMap;
     } else {
-        // fmt::println("Unexpected token at line => {} column => {}", tokenVec.at(_idx).startLine, tokenVec.at(_idx).startColumn);
+        // fmt::println("Unexpected token at line => {}", tokenTable.at(_idx).startLine);
         ASSERT(false);
     }
 
     switch (mapKind) {
     case MapKind::Map:
         // <retToken> = <tblToken>.map <leftBracketToken> <refToken> => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 2);
-        bodyStartToken = tokenVec.at(_idx + 5);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 2);
+        bodyStartToken = tokenTable.at(_idx + 5);
         _idx++;
         break;
     case MapKind::MapSimple:
         // <retToken> = <tblToken>.map <leftBracketToken> <funcToken> <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        funcToken      = tokenVec.at(_idx + 2);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        funcToken      = tokenTable.at(_idx + 2);
         bodyStartToken = funcToken;
         _idx++;
         break;
     case MapKind::MapZipWithIndex:
         // <retToken> = <tblToken>.map.zipWithIndex <leftBracketToken> (<refToken>, <idxToken>) => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 7);
-        bodyStartToken = tokenVec.at(_idx + 11);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 7);
+        bodyStartToken = tokenTable.at(_idx + 11);
         _idx += 3;
         break;
     case MapKind::ZipWithIndexMap:
         // <retToken> = <tblToken>.zipWithIndex.map <leftBracketToken> (<idxToken>, <refToken>) => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 6);
-        tblToken       = tokenVec.at(_idx - 4);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 3);
-        bodyStartToken = tokenVec.at(_idx + 9);
+        retToken       = tokenTable.at(_idx - 6);
+        tblToken       = tokenTable.at(_idx - 4);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 3);
+        bodyStartToken = tokenTable.at(_idx + 9);
         _idx++;
         break;
     default:
         ASSERT(false);
     }
 
-    if (processedTokenLines.count(tblToken.startLine) > 0 && processedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
-    }
-
-    auto token      = tokenVec.at(_idx);
-    auto startToken = token;
-    ASSERT(token.data == "{");
-
-    while (token.data == "{" || bracketCnt != 0) {
-        if (token.data == "}") {
-            bracketCnt--;
-            if (bracketCnt == 0) {
-                break;
-            }
-        } else if (token.data == "{") {
-            bracketCnt++;
-            parseMap(_idx + 1);
-        }
-
-        _idx++;
-        token = tokenVec.at(_idx);
-    }
+    rightBracketToken = tokenTable.at(findRightBracket(_idx, "{"));
 
     // MapSimple does not have return token
     if (mapKind != MapKind::MapSimple) {
-        auto tmpIdx = _idx;
-        while (tokenVec.at(tmpIdx).kind != TokenKind::Return) {
-            tmpIdx--;
-            if (tokenVec.at(tmpIdx).idx == tblToken.idx) {
-                ASSERT(false, "Cannot find return token!\n");
-            }
-        }
-        returnToken = tokenVec.at(tmpIdx);
-    }
-    rightBracketToken = token; // The final matched token is right bracket
-
-    processedTokenLines.insert(tblToken.startLine);
-    processedTokenColumns.insert(tblToken.startColumn);
-
-    // If the tblToken has been replaced, don't replace it again
-    if (replacedTokenLines.count(tblToken.startLine) > 0 && replacedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
-    } else {
-        replacedTokenLines.insert(tblToken.startLine);
-        replacedTokenColumns.insert(tblToken.startColumn);
+        int returnIdx = tokenTable.bodyReturn(_idx);
+        ASSERT(returnIdx >= 0, "Cannot find return token!");
+        returnToken = tokenTable.at(returnIdx);
     }
 
-    if (tblToken.startLine == bodyStartToken.startLine) {
-        oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, ") end");
-        if (mapKind == MapKind::MapSimple) {
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, "_tinsert(" + retToken.data + ", " + funcToken.data + "(" + refToken.data + ") ");
-        } else {
-            oldContentLines[returnToken.startLine - 1].replace(returnToken.startColumn, returnToken.endColumn - returnToken.startColumn, "_tinsert(" + retToken.data + ",");
-        }
-        oldContentLines[tblToken.startLine - 1].replace(retToken.startColumn, bodyStartToken.startColumn - retToken.startColumn, retToken.data + " = {}; for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ");
+    // The result is presized to the length of the source table and filled through a counter instead of `table.insert`. The counter lives in a
+    // `do ... end` block so that it does not take up a local slot of the enclosing function.
+    std::string counter = "_n_" + retToken.str();
+    std::string append  = counter + " = " + counter + " + 1; " + retToken.str() + "[" + counter + "] =";
+    replaceToken(rightBracketToken, " end end");
+    if (mapKind == MapKind::MapSimple) {
+        replaceToken(funcToken, append + " " + funcToken.str() + "(" + refToken.str() + ") ");
     } else {
-        oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, ") end");
-        oldContentLines[tblToken.startLine - 1] = oldContentLines[tblToken.startLine - 1].substr(0, retToken.startColumn) + retToken.data + " = {}; for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ";
-        if (mapKind == MapKind::MapSimple) {
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, "_tinsert(" + retToken.data + ", " + funcToken.data + "(" + refToken.data + ") ");
-        } else {
-            oldContentLines[returnToken.startLine - 1].replace(returnToken.startColumn, returnToken.endColumn - returnToken.startColumn, "_tinsert(" + retToken.data + ",");
-        }
-        for (int i = tblToken.startLine + 1; i <= bodyStartToken.startLine; i++) {
-            if (i == bodyStartToken.startLine) {
-                oldContentLines[i - 1].replace(0, bodyStartToken.startColumn, std::string(bodyStartToken.startColumn, ' '));
-            } else {
-                oldContentLines[i - 1] = "--[[line keeper]]";
-            }
-        }
+        replaceToken(returnToken, append);
     }
+    replace(startOffset(retToken), startOffset(bodyStartToken), retToken.str() + " = _tnew(#" + tblToken.str() + ", 0); do local " + counter + " = 0; " + loopHeader(idx, idxToken.str(), refToken.str(), tblToken.str()));
 }
 
 void CustomLuaTransformer::parseFilter(int idx) {
-    int bracketCnt = 0;
-    int _idx       = idx;
-
-    while (tokenVec.at(_idx).kind != TokenKind::Filter) {
-        _idx++;
-        if (tokenVec.at(_idx).kind == TokenKind::EndOfFile) {
-            return;
-        }
-    }
+    int _idx = idx;
 
     FilterKind filterKind;
     Token retToken;
@@ -673,486 +1046,3516 @@ void CustomLuaTransformer::parseFilter(int idx) {
     refToken.data = "ref";
     idxToken.data = "_";
 
-    if (tokenVec.at(_idx - 2).kind == TokenKind::Identifier) {
-        if (tokenVec.at(_idx + 2).kind == TokenKind::ZipWithIndex)
+    if (isName(tokenTable.kind(_idx - 2))) {
+        if (tokenTable.kind(_idx + 2) == TokenKind::ZipWithIndex)
             filterKind = FilterKind::FilterZipWithIndex;
-        else if (tokenVec.at(_idx + 2).kind == TokenKind::Identifier && tokenVec.at(_idx + 3).data == "}")
+        else if (isName(tokenTable.kind(_idx + 2)) && tokenTable.data(_idx + 3) == "}")
             filterKind = FilterKind::FilterSimple;
         else
             filterKind = FilterKind::Filter;
-    } else if (tokenVec.at(_idx - 2).kind == TokenKind::ZipWithIndex) {
+    } else if (tokenTable.kind(_idx - 2) == TokenKind::ZipWithIndex) {
         filterKind = FilterKind::ZipWithIndexFilter;
     } else {
-        // fmt::println("Unexpected token at line => {} column => {}", tokenVec.at(_idx).startLine, tokenVec.at(_idx).startColumn);
+        // fmt::println("Unexpected token at line => {}", tokenTable.at(_idx).startLine);
         ASSERT(false);
     }
 
     switch (filterKind) {
     case FilterKind::Filter:
         // <retToken> = <tblToken>.filter <leftBracketToken> <refToken> => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 2);
-        bodyStartToken = tokenVec.at(_idx + 5);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 2);
+        bodyStartToken = tokenTable.at(_idx + 5);
         _idx++;
         break;
     case FilterKind::FilterSimple:
         // <retToken> = <tblToken>.filter <leftBracketToken> <funcToken> <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        funcToken      = tokenVec.at(_idx + 2);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        funcToken      = tokenTable.at(_idx + 2);
         bodyStartToken = funcToken;
         _idx++;
         break;
     case FilterKind::FilterZipWithIndex:
         // <retToken> = <tblToken>.filter.zipWithIndex <leftBracketToken> (<refToken>, <idxToken>) => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 4);
-        tblToken       = tokenVec.at(_idx - 2);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 7);
-        bodyStartToken = tokenVec.at(_idx + 11);
+        retToken       = tokenTable.at(_idx - 4);
+        tblToken       = tokenTable.at(_idx - 2);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 7);
+        bodyStartToken = tokenTable.at(_idx + 11);
         _idx += 3;
         break;
     case FilterKind::ZipWithIndexFilter:
         // <retToken> = <tblToken>.zipWithIndex.filter <leftBracketToken> (<idxToken>, <refToken>) => <bodyStartToken> ... <returnToken> ... <rightBracketToken>
-        retToken       = tokenVec.at(_idx - 6);
-        tblToken       = tokenVec.at(_idx - 4);
-        refToken       = tokenVec.at(_idx + 5);
-        idxToken       = tokenVec.at(_idx + 3);
-        bodyStartToken = tokenVec.at(_idx + 9);
+        retToken       = tokenTable.at(_idx - 6);
+        tblToken       = tokenTable.at(_idx - 4);
+        refToken       = tokenTable.at(_idx + 5);
+        idxToken       = tokenTable.at(_idx + 3);
+        bodyStartToken = tokenTable.at(_idx + 9);
         _idx++;
         break;
     default:
         ASSERT(false);
     }
 
-    if (processedTokenLines.count(tblToken.startLine) > 0 && processedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
-    }
-
-    auto token      = tokenVec.at(_idx);
-    auto startToken = token;
-    ASSERT(token.data == "{");
-
-    while (token.data == "{" || bracketCnt != 0) {
-        if (token.data == "}") {
-            bracketCnt--;
-            if (bracketCnt == 0) {
-                break;
-            }
-        } else if (token.data == "{") {
-            bracketCnt++;
-            parseFilter(_idx + 1);
-        }
-
-        _idx++;
-        token = tokenVec.at(_idx);
-    }
+    rightBracketToken = tokenTable.at(findRightBracket(_idx, "{"));
 
     // FilterSimple does not have return token
     if (filterKind != FilterKind::FilterSimple) {
-        auto tmpIdx = _idx;
-        while (tokenVec.at(tmpIdx).kind != TokenKind::Return) {
-            tmpIdx--;
-            if (tokenVec.at(tmpIdx).idx == tblToken.idx) {
-                ASSERT(false, "Cannot find return token!\n");
-            }
-        }
-        returnToken = tokenVec.at(tmpIdx);
+        int returnIdx = tokenTable.bodyReturn(_idx);
+        ASSERT(returnIdx >= 0, "Cannot find return token!");
+        returnToken = tokenTable.at(returnIdx);
     }
-    rightBracketToken = token; // The final matched token is right bracket
 
-    processedTokenLines.insert(tblToken.startLine);
-    processedTokenColumns.insert(tblToken.startColumn);
-
-    if (replacedTokenLines.count(tblToken.startLine) > 0 && replacedTokenColumns.count(tblToken.startColumn) > 0) {
-        return;
+    // Same counter scheme as `map`, the size of the result is unknown so it is not presized
+    std::string counter = "_n_" + retToken.str();
+    std::string append  = counter + " = " + counter + " + 1; " + retToken.str() + "[" + counter + "] = " + refToken.str();
+    if (filterKind == FilterKind::FilterSimple) {
+        replaceToken(rightBracketToken, " end end");
+        replaceToken(funcToken, "if " + funcToken.str() + "(" + refToken.str() + ") then " + append + " end");
     } else {
-        replacedTokenLines.insert(tblToken.startLine);
-        replacedTokenColumns.insert(tblToken.startColumn);
+        replaceToken(rightBracketToken, " then " + append + " end end end");
+        replaceToken(returnToken, "if");
     }
+    replace(startOffset(retToken), startOffset(bodyStartToken), retToken.str() + " = {}; do local " + counter + " = 0; " + loopHeader(idx, idxToken.str(), refToken.str(), tblToken.str()));
+}
 
-    if (tblToken.startLine == bodyStartToken.startLine) {
-        if (filterKind == FilterKind::FilterSimple) {
-            oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, ") end end");
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, "if " + funcToken.data + "(" + refToken.data + ") then " + "_tinsert(" + retToken.data + ", " + refToken.data);
-        } else {
-            oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, " then _tinsert(" + retToken.data + ", " + refToken.data + ") end end");
-            oldContentLines[returnToken.startLine - 1].replace(returnToken.startColumn, returnToken.endColumn - returnToken.startColumn, "if");
+// Returns the operator indices of the chain started by the operator site at `idx`, which is just `idx` if the site is not chained. A chain
+// ends with its first `foreach` or short-circuiting operator, and only its first operator may use `zipWithIndex`.
+std::vector<int> CustomLuaTransformer::chainOperators(int idx) {
+    std::vector<int> ops{idx};
+    while (tokenTable.kind(ops.back()) == TokenKind::Map || tokenTable.kind(ops.back()) == TokenKind::Filter) {
+        int rightIdx = findRightBracket(siteLeftBracket(ops.back()), "{");
+        int nextIdx  = rightIdx + 2;
+        if (nextIdx >= (int)tokenTable.size() || tokenTable.data(rightIdx + 1) != ".") {
+            break;
         }
-        oldContentLines[tblToken.startLine - 1].replace(retToken.startColumn, bodyStartToken.startColumn - retToken.startColumn, retToken.data + " = {}; for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ");
-    } else {
-        if (filterKind == FilterKind::FilterSimple) {
-            oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.startColumn - rightBracketToken.endColumn, "end");
-            oldContentLines[tblToken.startLine - 1] = oldContentLines[tblToken.startLine - 1].substr(0, retToken.startColumn) + retToken.data + " = {}; for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ";
-            oldContentLines[funcToken.startLine - 1].replace(funcToken.startColumn, funcToken.endColumn - funcToken.startColumn, "if " + funcToken.data + "(" + refToken.data + ") then " + "_tinsert(" + retToken.data + ", " + refToken.data + ") end");
-        } else {
-            oldContentLines[rightBracketToken.startLine - 1].replace(rightBracketToken.startColumn, rightBracketToken.endColumn - rightBracketToken.startColumn, " then _tinsert(" + retToken.data + ", " + refToken.data + ") end end");
-            oldContentLines[tblToken.startLine - 1] = oldContentLines[tblToken.startLine - 1].substr(0, retToken.startColumn) + retToken.data + " = {}; for " + idxToken.data + ", " + refToken.data + " in ipairs(" + tblToken.data + ") do ";
-            oldContentLines[returnToken.startLine - 1].replace(returnToken.startColumn, returnToken.endColumn - returnToken.startColumn, "if");
+        auto kind = tokenTable.kind(nextIdx);
+        if (kind == TokenKind::ZipWithIndex || (isOperator(kind) && siteLeftBracket(nextIdx) == nextIdx + 3)) {
+            std::cerr << "[CustomLuaTransformer] " << filename_ << ":" << tokenTable[nextIdx].startLine << ": zipWithIndex is only supported on the first operator of a chain" << std::endl;
+            ASSERT(false, "Unsupported operator chain!");
         }
-        for (int i = tblToken.startLine + 1; i <= bodyStartToken.startLine; i++) {
-            if (i == bodyStartToken.startLine) {
-                oldContentLines[i - 1].replace(0, bodyStartToken.startColumn, std::string(bodyStartToken.startColumn, ' '));
-            } else {
-                oldContentLines[i - 1] = "--[[line keeper]]";
-            }
+        if (!isOperator(kind) || siteLeftBracket(nextIdx) < 0) {
+            break;
         }
+        ops.push_back(nextIdx);
     }
+    return ops;
 }
 
-void CustomLuaTransformer::parseCompTime(int idx) {
-    int bracketCnt = 0;
-    int _idx       = idx;
-
-    while (tokenVec.at(_idx).kind != TokenKind::CompTime) {
-        _idx++;
-        if (tokenVec.at(_idx).kind == TokenKind::EndOfFile) {
+ChainStage CustomLuaTransformer::chainStage(int idx) {
+    ChainStage stage;
+    stage.kind          = tokenTable.kind(idx);
+    stage.refToken.data = "ref";
+    stage.idxToken.data = "_";
+
+    int leftIdx             = siteLeftBracket(idx);
+    stage.rightBracketToken = tokenTable.at(findRightBracket(leftIdx, "{"));
+    if (leftIdx == idx + 3) {
+        // <op>.zipWithIndex <leftBracketToken> (<refToken>, <idxToken>) => <bodyStartToken> ... <rightBracketToken>
+        stage.zipWithIndex   = true;
+        stage.refToken       = tokenTable.at(leftIdx + 2);
+        stage.idxToken       = tokenTable.at(leftIdx + 4);
+        stage.bodyStartToken = tokenTable.at(leftIdx + 8);
+    } else if (tokenTable.kind(idx - 2) == TokenKind::ZipWithIndex) {
+        // zipWithIndex.<op> <leftBracketToken> (<idxToken>, <refToken>) => <bodyStartToken> ... <rightBracketToken>
+        stage.zipWithIndex   = true;
+        stage.idxToken       = tokenTable.at(leftIdx + 2);
+        stage.refToken       = tokenTable.at(leftIdx + 4);
+        stage.bodyStartToken = tokenTable.at(leftIdx + 8);
+    } else if ((isName(tokenTable.kind(leftIdx + 1)) || (stage.kind == TokenKind::Take && tokenTable.kind(leftIdx + 1) == TokenKind::Number)) && tokenTable.data(leftIdx + 2) == "}") {
+        // <op> <leftBracketToken> <funcToken> <rightBracketToken>, the count of `take`
+        stage.simple         = true;
+        stage.funcToken      = tokenTable.at(leftIdx + 1);
+        stage.bodyStartToken = stage.funcToken;
+    } else {
+        // <op> <leftBracketToken> <refToken> => <bodyStartToken> ... <rightBracketToken>
+        stage.refToken       = tokenTable.at(leftIdx + 1);
+        stage.bodyStartToken = tokenTable.at(leftIdx + 4);
+    }
+
+    if (stage.kind == TokenKind::Take && (!stage.simple || stage.zipWithIndex)) {
+        std::cerr << "[CustomLuaTransformer] " << filename_ << ":" << tokenTable.at(idx).startLine << ": take expects a count, e.g. take{10}" << std::endl;
+        ASSERT(false, "Invalid take!");
+    }
+    if (!stage.simple && stage.kind != TokenKind::Foreach) {
+        int returnIdx = tokenTable.bodyReturn(leftIdx);
+        ASSERT(returnIdx >= 0, "Cannot find return token!");
+        stage.returnToken = tokenTable.at(returnIdx);
+    }
+    return stage;
+}
+
+// A chain is fused into a single loop without intermediate tables: a `map` binds the value passed to the next operator as a local, a `filter`
+// opens an `if` around the rest of the chain, and the last operator either collects the values into the result table or is the `foreach` body.
+// A short-circuiting operator ends the loop with `break` once its result is known, it is parsed as a chain even if it is used alone.
+//   local ret = tbl.map{ x => return x * 2 }.filter{ y => return y > 2 }
+//   local ret = {}; do local _n_ret = 0; for _, x in ipairs(tbl) do local y = x * 2  if y > 2  then _n_ret = _n_ret + 1; ret[_n_ret] = y end end end
+void CustomLuaTransformer::parseChain(const std::vector<int> &ops) {
+    std::vector<ChainStage> stages;
+    for (int op : ops) {
+        stages.push_back(chainStage(op));
+    }
+    auto &first = stages.front();
+    auto &last  = stages.back();
+
+    int tblIdx       = tokenTable.kind(ops.front() - 2) == TokenKind::ZipWithIndex ? ops.front() - 4 : ops.front() - 2;
+    Token tblToken   = tokenTable.at(tblIdx);
+    bool hasResult   = last.kind != TokenKind::Foreach;
+    bool hasCounter  = last.kind == TokenKind::Map || last.kind == TokenKind::Filter || last.kind == TokenKind::Take || last.kind == TokenKind::TakeWhile;
+    Token retToken;
+    std::string ret;
+    std::string counter;
+    std::string append;
+    if (hasResult) {
+        // <retToken> = <tblToken>.<op>{...}.<op>{...}, the loop is a statement which assigns the result to a name. A site in an expression(e.g.
+        // `if tbl.any{...} then` or `print(tbl.find{...})`), assigned to a field or on a field would be rewritten into wrong code, so it is an error.
+        bool assigned = tblIdx >= 2 && tokenTable.data(tblIdx - 1) == "=" && isName(tokenTable.kind(tblIdx - 2)) && !(tblIdx >= 3 && (tokenTable.data(tblIdx - 3) == "." || tokenTable.data(tblIdx - 3) == ":"));
+        if (!assigned) {
+            std::cerr << "[CustomLuaTransformer] " << filename_ << ":" << tokenTable.at(ops.front()).startLine << ": the result of " << tokenTable.data(ops.back()) << " must be assigned to a variable and the table must be a variable, e.g. local r = "
+                      << tblToken.str() << "." << tokenTable.data(ops.front()) << "{...}" << std::endl;
+            ASSERT(false, "Unsupported operator site!");
+        }
+        retToken = tokenTable.at(tblIdx - 2);
+        ret      = retToken.str();
+        counter  = "_n_" + ret;
+        append   = counter + " = " + counter + " + 1; " + ret + "[" + counter + "] =";
+    }
+
+    // The value passed into each operator is named by the lambda of that operator, a simple operator keeps the name of the previous value
+    std::vector<std::string> values;
+    for (size_t i = 0; i < stages.size(); i++) {
+        values.push_back(!stages[i].simple ? stages[i].refToken.str() : (i == 0 ? std::string("ref") : values.back()));
+    }
+
+    std::string closers;
+    for (size_t i = 0; i + 1 < stages.size(); i++) {
+        auto &stage      = stages[i];
+        auto &value      = values[i];
+        auto &nextValue  = values[i + 1];
+        std::string link = " "; // Replaces the `}.<op>{ <refToken> =>` between two operators
+        if (stage.kind == TokenKind::Map) {
+            if (stage.simple) {
+                replaceToken(stage.funcToken, "local " + nextValue + " = " + stage.funcToken.str() + "(" + value + ")");
+            } else {
+                replaceToken(stage.returnToken, "local " + nextValue + " =");
+            }
+        } else {
+            std::string alias = nextValue != value ? "local " + nextValue + " = " + value + " " : "";
+            if (stage.simple) {
+                replaceToken(stage.funcToken, "if " + stage.funcToken.str() + "(" + value + ") then " + alias);
+            } else {
+                replaceToken(stage.returnToken, "if");
+                link = " then " + alias;
+            }
+            closers += "end ";
+        }
+        replace(startOffset(stage.rightBracketToken), startOffset(stages[i + 1].bodyStartToken), link);
+    }
+    closers += hasCounter ? "end end" : "end";
+
+    // The last operator tests its value with the lambda(up to its `return`) or with the simple function: `if [not] <test> then <action> end <next>`
+    auto &value = values.back();
+    auto test   = [&](bool negate, const std::string &action, const std::string &next) {
+        if (last.simple) {
+            replaceToken(last.funcToken, "if " + std::string(negate ? "not " : "") + last.funcToken.str() + "(" + value + ") then " + action + " end " + next);
+            replaceToken(last.rightBracketToken, closers);
+        } else {
+            replaceToken(last.returnToken, negate ? "if not (" : "if");
+            replaceToken(last.rightBracketToken, std::string(negate ? ")" : "") + " then " + action + " end " + next + closers);
+        }
+    };
+
+    std::string init;
+    switch (last.kind) {
+    case TokenKind::Foreach:
+        if (last.simple) {
+            replaceToken(last.funcToken, last.funcToken.str() + "(" + value + ") ");
+        }
+        replaceToken(last.rightBracketToken, closers);
+        break;
+    case TokenKind::Map:
+        if (last.simple) {
+            replaceToken(last.funcToken, append + " " + last.funcToken.str() + "(" + value + ") ");
+            replaceToken(last.rightBracketToken, closers);
+        } else {
+            replaceToken(last.returnToken, append);
+            replaceToken(last.rightBracketToken, " " + closers);
+        }
+        // Only a chain of maps knows the size of its result
+        init = std::all_of(stages.begin(), stages.end(), [](const ChainStage &stage) { return stage.kind == TokenKind::Map; }) ? "_tnew(#" + tblToken.str() + ", 0)" : "{}";
+        break;
+    case TokenKind::Filter:
+        test(false, append + " " + value, "");
+        init = "{}";
+        break;
+    case TokenKind::Find:
+        // The index in `tbl` of the first value passing the test
+        test(false, ret + " = " + first.idxToken.str() + " break", "");
+        init = "nil";
+        break;
+    case TokenKind::First:
+        test(false, ret + " = " + value + " break", "");
+        init = "nil";
+        break;
+    case TokenKind::Any:
+        test(false, ret + " = true break", "");
+        init = "false";
+        break;
+    case TokenKind::All:
+        test(true, ret + " = false break", "");
+        init = "true";
+        break;
+    case TokenKind::TakeWhile:
+        test(true, "break", append + " " + value + " ");
+        init = "{}";
+        break;
+    case TokenKind::Take:
+        // <retToken> = <tblToken>.take <leftBracketToken> <count> <rightBracketToken>
+        replaceToken(last.funcToken, "if " + counter + " >= " + last.funcToken.str() + " then break end " + append + " " + value + " ");
+        replaceToken(last.rightBracketToken, closers);
+        init = "{}";
+        break;
+    default:
+        ASSERT(false);
+    }
+
+    std::string loop = loopHeader(ops.front(), first.idxToken.str(), values.front(), tblToken.str());
+    if (hasCounter) {
+        replace(startOffset(retToken), startOffset(first.bodyStartToken), ret + " = " + init + "; do local " + counter + " = 0; " + loop);
+    } else if (hasResult) {
+        replace(startOffset(retToken), startOffset(first.bodyStartToken), ret + " = " + init + "; " + loop);
+    } else {
+        replace(startOffset(tblToken), startOffset(first.bodyStartToken), loop);
+    }
+}
+
+void CustomLuaTransformer::parseCompTime(int idx) {
+    int _idx = idx;
+
+    // compTimeToken [ "(" <compTimeName> ")" ] leftBracketToken <compTimeContent> rightBracketToken
+    Token compTimeToken = tokenTable.at(_idx);
+    Token compTimeNameOpt;
+    Token leftBracketToken;
+    Token rightBracketToken;
+
+    if (tokenTable.data(_idx + 1) == "(") {
+        compTimeNameOpt = tokenTable.at(_idx + 2);
+        ASSERT(tokenTable.data(_idx + 3) == ")");
+        _idx = _idx + 3;
+    } else {
+        compTimeNameOpt.data = "Unknown";
+    }
+
+    _idx++;
+    leftBracketToken  = tokenTable.at(_idx);
+    rightBracketToken = tokenTable.at(findRightBracket(_idx, "{"));
+    hasCompTime       = true;
+
+    std::string compTimeContent(getContentBetween(leftBracketToken, rightBracketToken));
+    TraceSpan span("comp_time " + compTimeNameOpt.str() + ":" + std::to_string(compTimeToken.startLine), filename_, compTimeContent.size());
+    std::string luaCode = runCompTime(filename_ + "/compTime/" + compTimeNameOpt.str() + ":" + std::to_string(compTimeToken.startLine), compTimeContent);
+
+    if (compact) {
+        // The generated lines would shift the rest of the file
+        replace(startOffset(compTimeToken), endOffset(rightBracketToken), flattenCode(luaCode));
+    } else {
+        replace(startOffset(compTimeToken), endOffset(rightBracketToken), "--[[comp_time]] " + luaCode);
+    }
+}
+
+void CustomLuaTransformer::addEnvDep(const std::string &name) {
+    if (std::find(envDeps.begin(), envDeps.end(), name) == envDeps.end()) {
+        envDeps.push_back(name);
+    }
+}
+
+// Run a `$comp_time` block, or take its result from the disk cache(LJP_COMPTIME_CACHE). The blocks of all the files loaded by a thread share
+// its Lua state, so the key of a block covers the code of every block before it in load order, across files(and `$include`s), and its entry
+// records the env_vars read by all of them. A block served from the cache is not run, it is replayed before the next block which has to be
+// run, whichever file it is in, so that the globals it defines are still there.
+std::string CustomLuaTransformer::runCompTime(const std::string &codeName, const std::string &code) {
+    auto addChainEnvDep = [&](const std::string &name) {
+        addEnvDep(name);
+        if (std::find(ctx_.compTimeEnvDeps.begin(), ctx_.compTimeEnvDeps.end(), name) == ctx_.compTimeEnvDeps.end()) {
+            ctx_.compTimeEnvDeps.push_back(name);
+        }
+    };
+
+    std::string cacheFile;
+    if (ctx_.cacheEnabled && ctx_.compTimeCacheEnabled) {
+        cacheFile = compTimeCacheFile(ctx_, filename_, code);
+        std::vector<std::string> cachedEnvDeps;
+        std::string output;
+        if (loadCompTime(cacheFile, cachedEnvDeps, output)) {
+            for (const auto &name : cachedEnvDeps) {
+                addChainEnvDep(name);
+            }
+            ctx_.compTimePending.emplace_back(codeName, code);
+            return output;
+        }
+    }
+
+    for (const auto &[pendingName, pendingCode] : ctx_.compTimePending) {
+        ctx_.luaDoString(pendingName.c_str(), pendingCode.c_str());
+    }
+    ctx_.compTimePending.clear();
+    std::string output = ctx_.luaDoString(codeName.c_str(), code.c_str());
+
+    // The names of the env_vars read since the last call, one per line(see the preamble in do_lua_stiring())
+    std::istringstream names(ctx_.luaDoString((codeName + "/env_vars").c_str(), "return __ljp_take_env_reads()"));
+    std::string name;
+    while (std::getline(names, name)) {
+        addChainEnvDep(name);
+    }
+
+    if (!cacheFile.empty()) {
+        storeCompTime(cacheFile, ctx_.compTimeEnvDeps, output);
+    }
+    return output;
+}
+
+void CustomLuaTransformer::parseInclude(int idx) {
+    int _idx = idx;
+
+    Token includeToken = tokenTable.at(_idx);
+    Token leftBracketToken;
+    Token rightBracketToken;
+
+    _idx++;
+    leftBracketToken  = tokenTable.at(_idx);
+    rightBracketToken = tokenTable.at(findRightBracket(_idx, "("));
+
+    std::string includePackage(getContentBetween(leftBracketToken, rightBracketToken));
+    TraceSpan span("include " + includePackage, filename_);
+
+    std::string codeName    = filename_ + "/include" + ":" + std::to_string(includeToken.startLine);
+    std::string includeFile = ctx_.includeGraph->resolve(ctx_, includePackage, codeName);
+
+    // The file is a dependency even if it is not expanded, it decides whether it is included once
+    IncludeNode node;
+    bool expanded = ctx_.includeGraph->include(ctx_, includeFile, node);
+    includeDeps.push_back(includeFile);
+    if (expanded) {
+        span.bytes = node.code.size();
+        includeDeps.insert(includeDeps.end(), node.result.deps.begin(), node.result.deps.end());
+        for (const auto &name : node.result.envDeps) {
+            addEnvDep(name);
+        }
+        hasCompTime = hasCompTime || !node.result.cacheable;
+    }
+
+    replace(startOffset(includeToken), endOffset(rightBracketToken), std::move(node.code));
+}
+
+// Single pass driver. Every operator site is visited once, and it is rewritten when its closing bracket is reached, so the sites nested
+// inside a body are always rewritten before the enclosing one. The tokens inside `$comp_time` and `$include` are plain Lua code and are skipped.
+void CustomLuaTransformer::parse(int idx) {
+    std::vector<std::pair<int, int>> pendingSites; // (right bracket index, operator index), innermost site on the top
+    std::unordered_map<int, std::vector<int>> chains; // Operators of the chains with more than one operator, by their first operator
+    std::vector<bool> chained(tokenTable.size(), false); // Operators which are rewritten together with the first operator of their chain
+
+    for (int _idx = idx; _idx < (int)tokenTable.size(); _idx++) {
+        while (!pendingSites.empty() && pendingSites.back().first == _idx) {
+            int siteIdx = pendingSites.back().second;
+            pendingSites.pop_back();
+
+            auto chain = chains.find(siteIdx);
+            if (chain != chains.end()) {
+                parseChain(chain->second);
+                continue;
+            }
+
+            // fmt::println("parse {:8} {:8}", tokenTable.data(siteIdx), toString(tokenTable.kind(siteIdx)));
+            switch (tokenTable.kind(siteIdx)) {
+            case TokenKind::Foreach:
+                parseForeach(siteIdx);
+                break;
+            case TokenKind::Map:
+                parseMap(siteIdx);
+                break;
+            case TokenKind::Filter:
+                parseFilter(siteIdx);
+                break;
+            case TokenKind::Find:
+            case TokenKind::Any:
+            case TokenKind::All:
+            case TokenKind::Take:
+            case TokenKind::First:
+            case TokenKind::TakeWhile:
+                parseChain({siteIdx});
+                break;
+            case TokenKind::CompTime:
+                parseCompTime(siteIdx);
+                break;
+            case TokenKind::Include:
+                parseInclude(siteIdx);
+                break;
+            default:
+                ASSERT(false);
+            }
+        }
+
+        auto kind = tokenTable.kind(_idx);
+        if (kind == TokenKind::EndOfFile) {
+            break;
+        }
+        if (!isOperator(kind) && kind != TokenKind::CompTime && kind != TokenKind::Include) {
+            continue;
+        }
+
+        int leftIdx = siteLeftBracket(_idx);
+        if (leftIdx < 0 || chained[_idx]) {
+            continue;
+        }
+        int rightIdx = findRightBracket(leftIdx, tokenTable.data(leftIdx));
+        // An annotation applies to a site of the statement following it, if the site starts on the first line of the statement(the table of
+        // the operator is on it), and is dropped otherwise
+        int headIdx = _idx >= 4 && tokenTable.kind(_idx - 2) == TokenKind::ZipWithIndex ? _idx - 4 : std::max(_idx - 2, 0);
+        for (; nextAnnotation_ < denseAnnotations_.size() && denseAnnotations_[nextAnnotation_] <= _idx; nextAnnotation_++) {
+            if (isOperator(kind) && tokenTable.line(denseAnnotations_[nextAnnotation_]) == tokenTable.line(headIdx)) {
+                denseSites_.insert(_idx);
+            }
+        }
+        if (isOperator(kind)) {
+            auto ops = chainOperators(_idx);
+            if (ops.size() > 1) {
+                for (size_t i = 1; i < ops.size(); i++) {
+                    chained[ops[i]] = true;
+                }
+                rightIdx = findRightBracket(siteLeftBracket(ops.back()), "{");
+                chains.emplace(_idx, std::move(ops));
+            }
+        }
+        pendingSites.emplace_back(rightIdx, _idx);
+
+        if (kind == TokenKind::CompTime || kind == TokenKind::Include) {
+            _idx = rightIdx - 1;
+        }
+    }
+}
+
+void CustomLuaTransformer::dumpContentLines(bool hasLineNumbers) {
+    std::cout << "\n\n";
+    std::istringstream lines(output());
+    std::string line;
+    for (int i = 1; std::getline(lines, line); i++) {
+        if (hasLineNumbers) {
+            std::cout << i << ": ";
+        }
+        std::cout << line << std::endl;
+    }
+}
+
+// 64-bit FNV-1a, only used to build content addressed cache keys
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t hashString(std::string_view str, uint64_t hash = 0xcbf29ce484222325ULL) {
+    // Hash the size as well so that ("ab", "c") and ("a", "bc") produce different keys
+    size_t size = str.size();
+    hash        = hashBytes((const char *)&size, sizeof(size), hash);
+    return hashBytes(str.data(), str.size(), hash);
+}
+
+std::string toHex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return std::string(buf);
+}
+
+bool readFile(const std::string &filename, std::string &content) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+// Read-only memory mapping of a whole file, the sources are scanned in place without being copied
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        map(fd);
+        close(fd);
+    }
+    // Maps a file opened by the caller, which keeps the descriptor
+    explicit MappedFile(int fd) { map(fd); }
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(data_, size_);
+        }
+    }
+
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const { return isOpen_; }
+    std::string_view view() const { return data_ != nullptr ? std::string_view((const char *)data_, size_) : std::string_view(); }
+
+  private:
+    void *data_  = nullptr;
+    size_t size_ = 0;
+    bool isOpen_ = false;
+
+    void map(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size_ = (size_t)st.st_size;
+            if (size_ == 0) {
+                isOpen_ = true;
+            } else {
+                void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    data_   = data;
+                    isOpen_ = true;
+                }
+            }
+        }
+    }
+};
+
+// Returns an empty string if the file can not be read
+std::string hashFile(const std::string &filename) {
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        return "";
+    }
+    return toHex(hashString(file.view()));
+}
+
+// A small C preprocessor which runs in memory and replaces the `cpp <file> -E | sed '/^#/d'` pipeline. It covers the subset used by
+// luajit-pro files: object-like and function-like macros(including `#`, `##` and `__VA_ARGS__`), `#undef`, `#if/#ifdef/#ifndef/#elif/#else/#endif`,
+// `#include`, `__LINE__` and `__FILE__`. Unlike `cpp` it knows about Lua strings and comments, macros are never expanded inside them.
+// Every directive or skipped line is replaced by an empty line, so the line numbers of the source are kept.
+class Preprocessor {
+  public:
+    std::vector<std::string> deps; // Files pulled in by `#include`
+
+    explicit Preprocessor(const std::vector<std::string> &defines);
+    std::string process(const std::string &filename, std::string_view content);
+
+    // Incremental process(), used by the streaming transform: begin() and then read() until it returns false. Every read() appends whole
+    // lines to `out`, at least `size` bytes of them unless the file ends.
+    void begin(const std::string &filename, std::string_view content);
+    bool read(size_t size, std::string &out);
+
+  private:
+    struct Macro {
+        bool isFunction = false;
+        bool isVariadic = false;
+        std::vector<std::string> params;
+        std::string body;
+    };
+
+    struct Conditional {
+        bool active;       // Lines of the current branch are emitted
+        bool taken;        // One of the branches has been taken
+        bool parentActive; // The enclosing branch is emitted
+        bool seenElse;
+    };
+
+    // A file being preprocessed, the position is always at the beginning of a line
+    struct FileState {
+        std::string_view content;
+        size_t pos = 0;
+        std::vector<Conditional> conds;
+        std::string savedFile;
+        int savedLine = 0;
+    };
+
+    std::unordered_map<std::string, Macro> macros_;
+    std::vector<std::string> disabled_; // Macros being expanded, they are not expanded again while rescanning
+    std::string currentFile_;
+    int currentLine_     = 1;
+    int pendingNewlines_ = 0; // Newlines swallowed by a multi-line macro invocation, emitted at the end of the line
+    int includeDepth_    = 0;
+    FileState root_; // The file read by read()
+
+    void processFile(const std::string &filename, std::string_view content, std::string &out);
+    void enterFile(FileState &file, const std::string &filename, std::string_view content);
+    bool processLine(FileState &file, std::string &out);
+    void leaveFile(FileState &file);
+    void handleDirective(const std::string &directive, std::vector<Conditional> &conds, std::string &out);
+    void define(const std::string &str);
+    void include(const std::string &str, std::string &out);
+    void expand(std::string_view text, size_t &pos, bool topLevel, std::string &out);
+    std::string expandString(std::string_view text);
+    bool collectArgs(std::string_view text, size_t &pos, std::vector<std::string> &args);
+    std::string substitute(const std::string &name, const Macro &macro, std::vector<std::string> &args);
+    long long evalCondition(const std::string &expr);
+    [[noreturn]] void error(const std::string &msg);
+
+    friend class ConditionParser;
+};
+
+static bool isIdentStart(char c) { return std::isalpha((unsigned char)c) || c == '_'; }
+static bool isIdentChar(char c) { return std::isalnum((unsigned char)c) || c == '_'; }
+
+static std::string trim(const std::string &str) {
+    auto start = str.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) {
+        return "";
+    }
+    auto end = str.find_last_not_of(" \t\r\n");
+    return str.substr(start, end - start + 1);
+}
+
+// Returns the level(number of `=`) if a Lua long bracket(e.g. `[[`, `[==[`) starts at `pos`, otherwise returns -1
+static int longBracketLevel(std::string_view text, size_t pos) {
+    if (pos >= text.size() || text[pos] != '[') {
+        return -1;
+    }
+    size_t p = pos + 1;
+    while (p < text.size() && text[p] == '=') {
+        p++;
+    }
+    return (p < text.size() && text[p] == '[') ? (int)(p - pos - 1) : -1;
+}
+
+// Returns the position after the closing long bracket, or the end of the text if it is not closed
+static size_t skipLongBracket(std::string_view text, size_t pos, int level) {
+    std::string close = "]" + std::string(level, '=') + "]";
+    auto end          = text.find(close, pos + level + 2);
+    return end == std::string::npos ? text.size() : end + close.size();
+}
+
+// Returns the position after the closing quote, a short string never spans multiple lines
+static size_t skipQuotedString(std::string_view text, size_t pos) {
+    char quote = text[pos];
+    size_t p   = pos + 1;
+    while (p < text.size() && text[p] != quote && text[p] != '\n') {
+        if (text[p] == '\\' && p + 1 < text.size()) {
+            p++;
+        }
+        p++;
+    }
+    return p < text.size() && text[p] == quote ? p + 1 : p;
+}
+
+static size_t skipSpaces(std::string_view text, size_t pos) {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r')) {
+        pos++;
+    }
+    return pos;
+}
+
+Preprocessor::Preprocessor(const std::vector<std::string> &defines) {
+    for (const auto &def : defines) {
+        // Same as `cpp -D`: "NAME" defines NAME as 1, "NAME=VALUE" defines NAME as VALUE
+        auto eq = def.find('=');
+        if (eq == std::string::npos) {
+            define(def + " 1");
+        } else {
+            define(def.substr(0, eq) + " " + def.substr(eq + 1));
+        }
+    }
+}
+
+void Preprocessor::error(const std::string &msg) {
+    std::cerr << "[luajit-pro] " << currentFile_ << ":" << currentLine_ << ": " << msg << std::endl;
+    ASSERT(false, "Preprocess failed");
+}
+
+std::string Preprocessor::process(const std::string &filename, std::string_view content) {
+    std::string out;
+    out.reserve(content.size());
+    processFile(filename, content, out);
+    return out;
+}
+
+void Preprocessor::begin(const std::string &filename, std::string_view content) { enterFile(root_, filename, content); }
+
+bool Preprocessor::read(size_t size, std::string &out) {
+    size_t start = out.size();
+    while (out.size() - start < size) {
+        if (!processLine(root_, out)) {
+            leaveFile(root_);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Preprocessor::processFile(const std::string &filename, std::string_view content, std::string &out) {
+    FileState file;
+    enterFile(file, filename, content);
+    while (processLine(file, out)) {
+    }
+    leaveFile(file);
+}
+
+void Preprocessor::enterFile(FileState &file, const std::string &filename, std::string_view content) {
+    file.content   = content;
+    file.savedFile = currentFile_;
+    file.savedLine = currentLine_;
+    currentFile_   = filename;
+    currentLine_   = 1;
+}
+
+// Process the line at the position of `file`, returns false if the file has ended
+bool Preprocessor::processLine(FileState &file, std::string &out) {
+    std::string_view content = file.content;
+    size_t &pos              = file.pos;
+    if (pos >= content.size()) {
+        return false;
+    }
+
+    size_t p = skipSpaces(content, pos);
+    if (p < content.size() && content[p] == '#') {
+        // Directive lines ending with '\' are continued on the next line
+        std::string directive;
+        int lines = 1;
+        p++;
+        while (p < content.size() && content[p] != '\n') {
+            if (content[p] == '\\' && p + 1 < content.size() && content[p + 1] == '\n') {
+                directive += ' ';
+                p += 2;
+                lines++;
+                continue;
+            }
+            directive += content[p++];
+        }
+        pos = p < content.size() ? p + 1 : p;
+        handleDirective(directive, file.conds, out);
+        out.append(lines, '\n');
+        currentLine_ += lines;
+        return true;
+    }
+
+    if (!file.conds.empty() && !file.conds.back().active) {
+        auto end = content.find('\n', pos);
+        pos      = end == std::string::npos ? content.size() : end + 1;
+        out += '\n';
+        currentLine_++;
+        return true;
+    }
+
+    expand(content, pos, true, out);
+    out.append(pendingNewlines_, '\n');
+    pendingNewlines_ = 0;
+    out += '\n';
+    pos++;
+    currentLine_++;
+    return true;
+}
+
+void Preprocessor::leaveFile(FileState &file) {
+    if (!file.conds.empty()) {
+        error("unterminated conditional directive");
+    }
+
+    currentFile_ = file.savedFile;
+    currentLine_ = file.savedLine;
+}
+
+void Preprocessor::handleDirective(const std::string &directive, std::vector<Conditional> &conds, std::string &out) {
+    size_t p = skipSpaces(directive, 0);
+    std::string name;
+    while (p < directive.size() && isIdentChar(directive[p])) {
+        name += directive[p++];
+    }
+    std::string rest = trim(directive.substr(p));
+    bool active      = conds.empty() || conds.back().active;
+
+    if (name == "if" || name == "ifdef" || name == "ifndef") {
+        bool value = false;
+        if (active) {
+            if (name == "if") {
+                value = evalCondition(rest) != 0;
+            } else {
+                bool isDefined = macros_.count(rest) > 0;
+                value          = name == "ifdef" ? isDefined : !isDefined;
+            }
+        }
+        conds.push_back({value, value, active, false});
+    } else if (name == "elif") {
+        if (conds.empty() || conds.back().seenElse) {
+            error("#elif without #if");
+        }
+        auto &cond = conds.back();
+        if (cond.taken || !cond.parentActive) {
+            cond.active = false;
+        } else {
+            cond.active = evalCondition(rest) != 0;
+            cond.taken  = cond.active;
+        }
+    } else if (name == "else") {
+        if (conds.empty() || conds.back().seenElse) {
+            error("#else without #if");
+        }
+        auto &cond    = conds.back();
+        cond.active   = cond.parentActive && !cond.taken;
+        cond.taken    = true;
+        cond.seenElse = true;
+    } else if (name == "endif") {
+        if (conds.empty()) {
+            error("#endif without #if");
+        }
+        conds.pop_back();
+    } else if (!active) {
+        // Other directives are ignored inside a skipped branch
+    } else if (name == "define") {
+        define(rest);
+    } else if (name == "undef") {
+        macros_.erase(rest);
+    } else if (name == "include") {
+        include(rest, out);
+    } else if (name == "error") {
+        error("#error " + rest);
+    } else if (name == "warning") {
+        std::cerr << "[luajit-pro] " << currentFile_ << ":" << currentLine_ << ": #warning " << rest << std::endl;
+    } else if (name == "pragma" || name == "line" || name.empty()) {
+        // Not supported, ignored
+    } else {
+        error("invalid preprocessing directive #" + name);
+    }
+}
+
+void Preprocessor::define(const std::string &str) {
+    size_t p = 0;
+    std::string name;
+    while (p < str.size() && isIdentChar(str[p])) {
+        name += str[p++];
+    }
+    if (name.empty() || !isIdentStart(name[0])) {
+        error("macro names must be identifiers");
+    }
+
+    Macro macro;
+    if (p < str.size() && str[p] == '(') {
+        // No space is allowed between the name and '(' of a function-like macro
+        macro.isFunction = true;
+        auto close       = str.find(')', p);
+        if (close == std::string::npos) {
+            error("missing ')' in macro parameter list");
+        }
+        std::stringstream ss(str.substr(p + 1, close - p - 1));
+        std::string param;
+        while (std::getline(ss, param, ',')) {
+            param = trim(param);
+            if (param == "...") {
+                macro.isVariadic = true;
+                macro.params.push_back("__VA_ARGS__");
+            } else if (!param.empty()) {
+                macro.params.push_back(param);
+            }
+        }
+        p = close + 1;
+    }
+    macro.body    = trim(str.substr(p));
+    macros_[name] = macro;
+}
+
+void Preprocessor::include(const std::string &str, std::string &out) {
+    std::string arg = str;
+    if (arg.empty() || (arg[0] != '"' && arg[0] != '<')) {
+        arg = trim(expandString(arg));
+    }
+    if (arg.size() < 2 || (arg[0] == '"' && arg.back() != '"') || (arg[0] == '<' && arg.back() != '>')) {
+        error("#include expects \"FILENAME\" or <FILENAME>");
+    }
+    std::string name = arg.substr(1, arg.size() - 2);
+
+    // Search the directory of the current file first and then the working directory
+    std::filesystem::path path = std::filesystem::path(currentFile_).parent_path() / name;
+    if (!std::filesystem::exists(path)) {
+        path = name;
+    }
+    if (!std::filesystem::exists(path)) {
+        error(name + ": No such file or directory");
+    }
+    if (includeDepth_ >= 200) {
+        error("#include nested depth 200 exceeds maximum");
+    }
+
+    std::string includeFile = path.lexically_normal().string();
+    MappedFile file(includeFile);
+    if (!file.isOpen()) {
+        error("cannot read " + includeFile);
+    }
+    deps.push_back(includeFile);
+
+    // The included content replaces the directive line, the newline of the directive is emitted by the caller
+    std::string included;
+    includeDepth_++;
+    processFile(includeFile, file.view(), included);
+    includeDepth_--;
+    if (!included.empty() && included.back() == '\n') {
+        included.pop_back();
+    }
+    out += included;
+}
+
+std::string Preprocessor::expandString(std::string_view text) {
+    std::string out;
+    size_t pos = 0;
+    expand(text, pos, false, out);
+    return out;
+}
+
+// Expand the macros in `text` starting from `pos`. At the top level it stops at the end of the current line, nested expansions consume the whole text.
+void Preprocessor::expand(std::string_view text, size_t &pos, bool topLevel, std::string &out) {
+    while (pos < text.size()) {
+        char c = text[pos];
+
+        if (c == '\n') {
+            if (topLevel) {
+                return;
+            }
+            out += c;
+            pos++;
+            continue;
+        }
+
+        // Strings and comments are copied as is
+        size_t end = pos;
+        if (c == '"' || c == '\'') {
+            end = skipQuotedString(text, pos);
+        } else if (c == '[' && longBracketLevel(text, pos) >= 0) {
+            end = skipLongBracket(text, pos, longBracketLevel(text, pos));
+        } else if (c == '-' && pos + 1 < text.size() && text[pos + 1] == '-') {
+            int level = longBracketLevel(text, pos + 2);
+            if (level >= 0) {
+                end = skipLongBracket(text, pos + 2, level);
+            } else {
+                end = text.find('\n', pos);
+                end = end == std::string::npos ? text.size() : end;
+            }
+        } else if (std::isdigit((unsigned char)c)) {
+            // Numbers like `0x1F` or `1e10` must not be treated as identifiers
+            end = pos + 1;
+            while (end < text.size() && (isIdentChar(text[end]) || text[end] == '.' || ((text[end] == '+' || text[end] == '-') && std::strchr("eEpP", text[end - 1])))) {
+                end++;
+            }
+        }
+        if (end != pos) {
+            if (topLevel) {
+                currentLine_ += std::count(text.begin() + pos, text.begin() + end, '\n');
+            }
+            out.append(text, pos, end - pos);
+            pos = end;
+            continue;
+        }
+
+        if (!isIdentStart(c)) {
+            out += c;
+            pos++;
+            continue;
+        }
+
+        size_t start = pos;
+        while (pos < text.size() && isIdentChar(text[pos])) {
+            pos++;
+        }
+        std::string ident(text.substr(start, pos - start));
+
+        if (ident == "__LINE__") {
+            out += std::to_string(currentLine_);
+            continue;
+        } else if (ident == "__FILE__") {
+            out += "\"" + currentFile_ + "\"";
+            continue;
+        }
+
+        auto it = macros_.find(ident);
+        if (it == macros_.end() || std::find(disabled_.begin(), disabled_.end(), ident) != disabled_.end()) {
+            out += ident;
+            continue;
+        }
+        const Macro &macro = it->second;
+
+        if (!macro.isFunction) {
+            disabled_.push_back(ident);
+            out += expandString(macro.body);
+            disabled_.pop_back();
+            continue;
+        }
+
+        // A function-like macro name which is not followed by '(' is not an invocation
+        size_t p = pos;
+        while (p < text.size() && std::isspace((unsigned char)text[p])) {
+            p++;
+        }
+        if (p >= text.size() || text[p] != '(') {
+            out += ident;
+            continue;
+        }
+
+        std::vector<std::string> args;
+        if (!collectArgs(text, p, args)) {
+            error("unterminated argument list invoking macro \"" + ident + "\"");
+        }
+        int consumedLines = std::count(text.begin() + pos, text.begin() + p, '\n');
+        pos               = p;
+
+        auto body = substitute(ident, macro, args);
+        disabled_.push_back(ident);
+        auto expanded = expandString(body);
+        disabled_.pop_back();
+        out += expanded;
+
+        if (topLevel) {
+            // Keep the line numbers of the following lines when the invocation spans multiple lines
+            int emittedLines = std::count(expanded.begin(), expanded.end(), '\n');
+            pendingNewlines_ += std::max(0, consumedLines - emittedLines);
+            currentLine_ += consumedLines;
+        }
+    }
+}
+
+// `pos` points to the '(' of the invocation and is moved after the matching ')'.
+// Lua table constructors and indexing are treated as nested brackets, so `F({1, 2})` has a single argument.
+bool Preprocessor::collectArgs(std::string_view text, size_t &pos, std::vector<std::string> &args) {
+    int depth = 0;
+    std::string arg;
+    size_t p = pos + 1;
+    while (p < text.size()) {
+        char c = text[p];
+        if (c == '"' || c == '\'' || (c == '[' && longBracketLevel(text, p) >= 0)) {
+            size_t end = c == '[' ? skipLongBracket(text, p, longBracketLevel(text, p)) : skipQuotedString(text, p);
+            arg.append(text, p, end - p);
+            p = end;
+            continue;
+        }
+        if (c == '(' || c == '{' || c == '[') {
+            depth++;
+        } else if ((c == ')' || c == '}' || c == ']') && depth > 0) {
+            depth--;
+        } else if (c == ')') {
+            args.push_back(trim(arg));
+            pos = p + 1;
+            return true;
+        } else if (c == ',' && depth == 0) {
+            args.push_back(trim(arg));
+            arg.clear();
+            p++;
+            continue;
+        }
+        arg += c;
+        p++;
+    }
+    return false;
+}
+
+static std::string stringify(const std::string &arg) {
+    std::string out = "\"";
+    bool inSpace    = false;
+    for (char c : arg) {
+        if (std::isspace((unsigned char)c)) {
+            inSpace = true;
+            continue;
+        }
+        if (inSpace && out.size() > 1) {
+            out += ' ';
+        }
+        inSpace = false;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+std::string Preprocessor::substitute(const std::string &name, const Macro &macro, std::vector<std::string> &args) {
+    if (args.size() == 1 && args[0].empty() && macro.params.empty()) {
+        args.clear();
+    }
+    if (macro.isVariadic) {
+        size_t named = macro.params.size() - 1;
+        if (args.size() < named) {
+            error("macro \"" + name + "\" requires " + std::to_string(named) + " arguments, but only " + std::to_string(args.size()) + " given");
+        }
+        std::string vaArgs;
+        for (size_t i = named; i < args.size(); i++) {
+            vaArgs += (i == named ? "" : ", ") + args[i];
+        }
+        args.resize(named);
+        args.push_back(vaArgs);
+    } else if (args.size() != macro.params.size()) {
+        error("macro \"" + name + "\" passed " + std::to_string(args.size()) + " arguments, but takes " + std::to_string(macro.params.size()));
+    }
+
+    auto paramIndex = [&](const std::string &ident) -> int {
+        for (size_t i = 0; i < macro.params.size(); i++) {
+            if (macro.params[i] == ident) {
+                return (int)i;
+            }
+        }
+        return -1;
+    };
+
+    const std::string &body = macro.body;
+    std::string out;
+    bool pasteNext = false;
+    size_t p       = 0;
+    while (p < body.size()) {
+        char c = body[p];
+        if (c == '"' || c == '\'') {
+            size_t end = skipQuotedString(body, p);
+            out.append(body, p, end - p);
+            p = end;
+        } else if (c == '#' && p + 1 < body.size() && body[p + 1] == '#') {
+            // Token pasting, the operands are not macro-expanded
+            while (!out.empty() && std::isspace((unsigned char)out.back())) {
+                out.pop_back();
+            }
+            p         = skipSpaces(body, p + 2);
+            pasteNext = true;
+        } else if (c == '#') {
+            size_t q = skipSpaces(body, p + 1);
+            size_t e = q;
+            while (e < body.size() && isIdentChar(body[e])) {
+                e++;
+            }
+            int idx = paramIndex(body.substr(q, e - q));
+            if (idx < 0) {
+                error("'#' is not followed by a macro parameter");
+            }
+            out += stringify(args[idx]);
+            p = e;
+        } else if (isIdentStart(c)) {
+            size_t e = p;
+            while (e < body.size() && isIdentChar(body[e])) {
+                e++;
+            }
+            std::string ident = body.substr(p, e - p);
+            int idx           = paramIndex(ident);
+            if (idx < 0) {
+                out += ident;
+            } else {
+                size_t next   = skipSpaces(body, e);
+                bool beforeOp = next + 1 < body.size() && body[next] == '#' && body[next + 1] == '#';
+                out += (pasteNext || beforeOp) ? args[idx] : expandString(args[idx]);
+            }
+            pasteNext = false;
+            p         = e;
+        } else {
+            out += c;
+            pasteNext = false;
+            p++;
+        }
+    }
+    return out;
+}
+
+// Recursive descent parser for the integer constant expression of `#if` and `#elif`
+class ConditionParser {
+  public:
+    ConditionParser(Preprocessor &pp, const std::string &expr) : pp_(pp), expr_(expr) {}
+
+    long long parse() {
+        auto value = parseTernary();
+        skip();
+        if (pos_ < expr_.size()) {
+            pp_.error("invalid token in #if expression: " + expr_.substr(pos_));
+        }
+        return value;
+    }
+
+  private:
+    Preprocessor &pp_;
+    const std::string &expr_;
+    size_t pos_ = 0;
+
+    void skip() { pos_ = skipSpaces(expr_, pos_); }
+
+    bool accept(const char *op) {
+        skip();
+        size_t len = std::strlen(op);
+        if (expr_.compare(pos_, len, op) != 0) {
+            return false;
+        }
+        // Do not take `<` from `<<` or `|` from `||`
+        if (len == 1 && pos_ + 1 < expr_.size() && expr_[pos_ + 1] == op[0] && std::strchr("<>&|", op[0])) {
+            return false;
+        }
+        if (len == 1 && pos_ + 1 < expr_.size() && expr_[pos_ + 1] == '=' && std::strchr("<>!=", op[0])) {
+            return false;
+        }
+        pos_ += len;
+        return true;
+    }
+
+    long long parseTernary() {
+        auto cond = parseBinary(0);
+        if (accept("?")) {
+            auto lhs = parseTernary();
+            if (!accept(":")) {
+                pp_.error("expected ':' in #if expression");
+            }
+            auto rhs = parseTernary();
+            return cond ? lhs : rhs;
+        }
+        return cond;
+    }
+
+    long long parseBinary(int level) {
+        static const std::vector<std::vector<const char *>> levels = {
+            {"||"}, {"&&"}, {"|"}, {"^"}, {"&"}, {"==", "!="}, {"<=", ">=", "<", ">"}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"},
+        };
+        if (level == (int)levels.size()) {
+            return parseUnary();
+        }
+
+        auto lhs = parseBinary(level + 1);
+        while (true) {
+            const char *matched = nullptr;
+            for (auto op : levels[level]) {
+                if (accept(op)) {
+                    matched = op;
+                    break;
+                }
+            }
+            if (matched == nullptr) {
+                return lhs;
+            }
+
+            auto rhs       = parseBinary(level + 1);
+            std::string op = matched;
+            if ((op == "/" || op == "%") && rhs == 0) {
+                pp_.error("division by zero in #if");
+            }
+            if (op == "||") lhs = lhs || rhs;
+            else if (op == "&&") lhs = lhs && rhs;
+            else if (op == "|") lhs = lhs | rhs;
+            else if (op == "^") lhs = lhs ^ rhs;
+            else if (op == "&") lhs = lhs & rhs;
+            else if (op == "==") lhs = lhs == rhs;
+            else if (op == "!=") lhs = lhs != rhs;
+            else if (op == "<=") lhs = lhs <= rhs;
+            else if (op == ">=") lhs = lhs >= rhs;
+            else if (op == "<") lhs = lhs < rhs;
+            else if (op == ">") lhs = lhs > rhs;
+            else if (op == "<<") lhs = lhs << rhs;
+            else if (op == ">>") lhs = lhs >> rhs;
+            else if (op == "+") lhs = lhs + rhs;
+            else if (op == "-") lhs = lhs - rhs;
+            else if (op == "*") lhs = lhs * rhs;
+            else if (op == "/") lhs = lhs / rhs;
+            else if (op == "%") lhs = lhs % rhs;
+        }
+    }
+
+    long long parseUnary() {
+        if (accept("!")) return !parseUnary();
+        if (accept("~")) return ~parseUnary();
+        if (accept("-")) return -parseUnary();
+        if (accept("+")) return parseUnary();
+        return parsePrimary();
+    }
+
+    long long parsePrimary() {
+        skip();
+        if (accept("(")) {
+            auto value = parseTernary();
+            if (!accept(")")) {
+                pp_.error("missing ')' in #if expression");
+            }
+            return value;
+        }
+        if (pos_ < expr_.size() && std::isdigit((unsigned char)expr_[pos_])) {
+            size_t end;
+            long long value = std::stoll(expr_.substr(pos_), &end, 0);
+            pos_ += end;
+            while (pos_ < expr_.size() && std::strchr("uUlL", expr_[pos_])) {
+                pos_++;
+            }
+            return value;
+        }
+        if (pos_ < expr_.size() && isIdentStart(expr_[pos_])) {
+            // Identifiers left after macro expansion evaluate to 0
+            while (pos_ < expr_.size() && isIdentChar(expr_[pos_])) {
+                pos_++;
+            }
+            return 0;
+        }
+        pp_.error("invalid #if expression: " + expr_);
+    }
+};
+
+long long Preprocessor::evalCondition(const std::string &expr) {
+    // Replace `defined NAME` and `defined(NAME)` before the macros are expanded
+    std::string replaced;
+    size_t p = 0;
+    while (p < expr.size()) {
+        if (!isIdentStart(expr[p])) {
+            replaced += expr[p++];
+            continue;
+        }
+        size_t e = p;
+        while (e < expr.size() && isIdentChar(expr[e])) {
+            e++;
+        }
+        if (expr.compare(p, e - p, "defined") != 0) {
+            replaced.append(expr, p, e - p);
+            p = e;
+            continue;
+        }
+
+        size_t q     = skipSpaces(expr, e);
+        bool paren   = q < expr.size() && expr[q] == '(';
+        q            = skipSpaces(expr, paren ? q + 1 : q);
+        size_t start = q;
+        while (q < expr.size() && isIdentChar(expr[q])) {
+            q++;
+        }
+        std::string name = expr.substr(start, q - start);
+        if (name.empty()) {
+            error("operator \"defined\" requires an identifier");
+        }
+        if (paren) {
+            q = skipSpaces(expr, q);
+            if (q >= expr.size() || expr[q] != ')') {
+                error("missing ')' after \"defined\"");
+            }
+            q++;
+        }
+        replaced += macros_.count(name) > 0 ? " 1 " : " 0 ";
+        p = q;
+    }
+
+    auto expanded = expandString(replaced);
+    return ConditionParser(*this, expanded).parse();
+}
+
+// Write to a temporary file first and then rename it, so that concurrent processes never observe a partially written cache entry.
+// Failures are not fatal(e.g. read-only filesystem), the entry is simply not cached.
+bool writeFileAtomic(const std::string &filename, const std::string &content) {
+    // Unique per thread, the cache directory may be shared by the VMs running on different threads
+    std::string tmpFile = filename + ".tmp." + std::to_string((int)getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream outFile(tmpFile, std::ios::binary | std::ios::trunc);
+        if (!outFile.is_open() || !outFile.write(content.data(), content.size())) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpFile, filename, ec);
+    if (ec) {
+        std::remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The value of an environment variable as recorded by the caches, "-" if it is not set
+std::string hashEnv(const std::string &name) {
+    const char *value = std::getenv(name.c_str());
+    return value != nullptr ? toHex(hashString(value)) : std::string("-");
+}
+
+// The manifest records the hash of every dependency at the time the cache entry was created, one "<hash> <path>" per line for the files
+// and one "env <hash> <name>" per line for the env_vars read by `$comp_time`
+bool validateManifest(const std::string &manifestFile, std::vector<std::string> &deps, std::vector<std::string> &envDeps) {
+    std::ifstream file(manifestFile);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, 4, "env ") == 0) {
+            auto space = line.find(' ', 4);
+            if (space == std::string::npos) {
+                return false;
+            }
+            auto name = line.substr(space + 1);
+            if (hashEnv(name) != line.substr(4, space - 4)) {
+                return false;
+            }
+            envDeps.push_back(name);
+            continue;
+        }
+        auto space = line.find(' ');
+        if (space == std::string::npos) {
+            return false;
+        }
+        auto depFile = line.substr(space + 1);
+        if (hashFile(depFile) != line.substr(0, space)) {
+            return false;
+        }
+        deps.push_back(depFile);
+    }
+    return true;
+}
+
+// `<basename>.<key>.ct` in the cache directory, the key covers the file and the code of the blocks run by the thread up to this one, which
+// is added to TransformerContext::compTimeState
+std::string compTimeCacheFile(TransformerContext &ctx, const std::string &filename, const std::string &code) {
+    std::filesystem::path filepath(filename);
+    ctx.compTimeState = hashString(code, ctx.compTimeState);
+
+    uint64_t key = hashString(LJ_PRO_VERSION);
+    key          = hashString(std::filesystem::absolute(filepath).lexically_normal().string(), key);
+    key          = hashString(toHex(ctx.compTimeState), key);
+    return ctx.cacheDir + "/" + filepath.filename().string() + "." + toHex(key) + ".ct";
+}
+
+// A cached block is one "<hash> <name>" line per env_var, an empty line and the output of the block
+bool loadCompTime(const std::string &cacheFile, std::vector<std::string> &envDeps, std::string &output) {
+    std::string content;
+    if (!readFile(cacheFile, content)) {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (true) {
+        auto end = content.find('\n', pos);
+        if (end == std::string::npos) {
+            return false;
+        }
+        if (end == pos) {
+            break;
+        }
+        auto space = content.find(' ', pos);
+        if (space == std::string::npos || space > end) {
+            return false;
+        }
+        auto name = content.substr(space + 1, end - space - 1);
+        if (hashEnv(name) != content.substr(pos, space - pos)) {
+            return false;
+        }
+        envDeps.push_back(name);
+        pos = end + 1;
+    }
+    output = content.substr(pos + 1);
+    return true;
+}
+
+void storeCompTime(const std::string &cacheFile, const std::vector<std::string> &envDeps, const std::string &output) {
+    std::string content;
+    for (const auto &name : envDeps) {
+        content += hashEnv(name) + " " + name + "\n";
+    }
+    content += "\n" + output;
+    writeFileAtomic(cacheFile, content);
+}
+
+TransformResult transformFile(TransformerContext &ctx, const std::string &filename) {
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        std::cerr << "[luajit-pro] Cannot open file: " << filename << std::endl;
+        ASSERT(false, "Cannot open file!");
+    }
+    return transformSource(ctx, filename, file.view());
+}
+
+// Returns true if the first line of `source` has the "--[[luajit-pro]]" directive
+static bool parseDirective(std::string_view source, bool &disablePreprocess) {
+    auto firstLine = source.substr(0, source.find('\n'));
+    // std::cout << "[Debug] first line => " << firstLine << std::endl;
+
+    // You can DISABLE preprocess by adding "preprocess: false" at the first line of the file after the "--[[luajit-pro]]" comment. e.g. "--[[luajit-pro]] preprocess: false"
+    disablePreprocess = directiveOption(firstLine, "preprocess") == "false";
+
+    return firstLine.find("--[[luajit-pro]]") != std::string_view::npos;
+}
+
+// Returns the path of the cache entry of a luajit-pro file without the suffix, shared by the transform cache(".lua" and ".deps") and the bytecode cache(".bc").
+// The cache key covers everything that is known before preprocessing, the included files are checked against the manifest afterwards.
+static std::string cacheEntry(TransformerContext &ctx, const std::string &filename, std::string_view source) {
+    std::filesystem::path filepath(filename);
+
+    uint64_t key = hashString(LJ_PRO_VERSION);
+    key          = hashString(std::filesystem::absolute(filepath).lexically_normal().string(), key);
+    for (const auto &define : ctx.defines) {
+        key = hashString(define, key);
+    }
+    key = hashString(ctx.compact ? "compact" : "", key);
+    key = hashString(source, key);
+
+    return ctx.cacheDir + "/" + filepath.filename().string() + "." + toHex(key);
+}
+
+// The bytecode is only valid for the VM build it was dumped by, and for the exact manifest of the transform cache entry, so that a change
+// of an included file never loads stale bytecode. The chunk name is part of the bytecode, so it is part of the key as well.
+static bool bytecodeCacheFile(TransformerContext &ctx, const std::string &filename, std::string_view source, const char *vmTag, std::string &bytecodeFile) {
+    std::string entry = cacheEntry(ctx, filename, source);
+    std::string manifest;
+    std::vector<std::string> deps;
+    std::vector<std::string> envDeps;
+    if (!readFile(entry + ".deps", manifest) || !validateManifest(entry + ".deps", deps, envDeps)) {
+        return false;
+    }
+
+    uint64_t key = hashString(vmTag);
+    key          = hashString(filename, key);
+    key          = hashString(manifest, key);
+    bytecodeFile = entry + "." + toHex(key) + ".bc";
+    return true;
+}
+
+// The operator names which can follow a `.` in an operator site, see siteLeftBracket()
+static bool isOperatorName(std::string_view word) { return isOperator(keywordKind(word)) || word == "zipWithIndex"; }
+
+// Whether the `$` or `.` at `pos` may start the extended syntax: `$comp_time`/`$include`, or `.<operator>`. The strings and comments around
+// `pos` are not known, so a hit is only a candidate, but a miss is certain. Like the lexer, the whitespace and comments between the `.` and
+// the name are skipped.
+static bool isTriggerAt(std::string_view input, size_t pos) {
+    if (input[pos] == '$') {
+        return true;
+    }
+    size_t p = pos + 1;
+    while (true) {
+        while (p < input.size() && std::isspace((unsigned char)input[p])) {
+            p++;
+        }
+        if (p + 1 >= input.size() || input[p] != '-' || input[p + 1] != '-') {
+            break;
+        }
+        int level = longBracketLevel(input, p + 2);
+        if (level >= 0) {
+            p = skipLongBracket(input, p + 2, level);
+        } else {
+            p = std::min(input.find('\n', p), input.size());
+        }
+    }
+    size_t end = p;
+    while (end < input.size() && isWordChar(input[end])) {
+        end++;
+    }
+    return isOperatorName(input.substr(p, end - p));
+}
+
+static bool scanTriggersScalar(std::string_view input, size_t pos) {
+    for (; pos < input.size(); pos++) {
+        if ((input[pos] == '$' || input[pos] == '.') && isTriggerAt(input, pos)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#if defined(__x86_64__)
+// The candidate bytes(`$` and `.`) of 16/32 bytes are found with two compares, only the candidates are checked one by one
+static bool scanTriggersSSE2(std::string_view input) {
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i dot    = _mm_set1_epi8('.');
+    size_t pos           = 0;
+    for (; pos + 16 <= input.size(); pos += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(input.data() + pos));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, dollar), _mm_cmpeq_epi8(block, dot)));
+        for (; mask != 0; mask &= mask - 1) {
+            if (isTriggerAt(input, pos + __builtin_ctz(mask))) {
+                return true;
+            }
+        }
+    }
+    return scanTriggersScalar(input, pos);
+}
+
+__attribute__((target("avx2"))) static bool scanTriggersAVX2(std::string_view input) {
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i dot    = _mm256_set1_epi8('.');
+    size_t pos           = 0;
+    for (; pos + 32 <= input.size(); pos += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(input.data() + pos));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, dollar), _mm256_cmpeq_epi8(block, dot)));
+        for (; mask != 0; mask &= mask - 1) {
+            if (isTriggerAt(input, pos + __builtin_ctz(mask))) {
+                return true;
+            }
+        }
+    }
+    return scanTriggersScalar(input, pos);
+}
+#endif
+
+// Pre-scan of the transformer input. Many files have the directive only for the preprocessor, the tokenizer and the parser are skipped for
+// them, which leaves the output(the directive line rewritten) at the cost of a copy. Returns true if the input may have an operator site,
+// a `$comp_time` or an `$include`.
+static bool hasExtendedSyntax(std::string_view input) {
+#if defined(__x86_64__)
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2 ? scanTriggersAVX2(input) : scanTriggersSSE2(input);
+#else
+    return scanTriggersScalar(input, 0);
+#endif
+}
+
+// Finds the places where a preprocessed luajit-pro source can be cut into pieces which are transformed one by one: the start of a line(outside
+// of strings and comments) which either begins with a keyword outside of any bracket, or follows a `,` or `;` between the fields of a table
+// constructor which is assigned or returned, e.g. `return {` or `M.data = {`, the usual layout of generated data modules. The header of an
+// operator site has no keyword, `,` or `;`, and the bodies of the sites, `$comp_time` and `$include` are brackets which are never cut, so
+// every site is transformed as a whole. The comment lines right before such a line go with it, so a `--[[dense]]` annotation is usually in the
+// same piece as its site. The text can grow between the calls, every byte is scanned once.
+class BoundaryScanner {
+  public:
+    // Returns the first boundary at or after `target`, or npos if the text ends before one is found. The scan continues from where the
+    // previous call stopped.
+    size_t next(std::string_view text, size_t target);
+    // The first `size` bytes of the text have been dropped, the offsets of the next calls are relative to the rest
+    void consume(size_t size) {
+        pos_ -= size;
+        cutStart_ -= size;
+    }
+
+  private:
+    struct Bracket {
+        bool fields;    // A table constructor which is assigned or returned, it can be cut between its fields
+        int blockDepth; // The fields are not cut inside of the functions defined in the table
+    };
+
+    size_t pos_       = 0;
+    size_t cutStart_  = 0;    // The line after the last line with a token
+    bool atLineStart_ = true; // No token has been seen on the line yet
+    int longLevel_    = -1;   // Inside a long string or a long comment of this level
+    char prev_        = '\n'; // The last character of the last token, `w` for a word and `=` only for an assignment
+    bool prevReturn_  = false;
+    int blockDepth_   = 0; // `function`, `do`, `if` and `repeat` minus `end` and `until`
+    std::vector<Bracket> brackets_;
+    int otherBrackets_ = 0; // Open brackets which are not tables of fields, e.g. a site body with a table inside
+};
+
+// How the boundary scanner sees a word: `b` begins a block, `e` ends one, `r` is `return`, `k` is another keyword which a statement line may begin
+// with, and `w` is anything else. The words are compared by their first letter, the scanner is on the serial part of the parallel transform.
+static char scannerWordClass(std::string_view word) {
+    switch (word[0]) {
+    case 'a':
+        return word == "and" ? 'k' : 'w';
+    case 'b':
+        return word == "break" ? 'k' : 'w';
+    case 'd':
+        return word == "do" ? 'b' : 'w';
+    case 'e':
+        return word == "end" ? 'e' : (word == "else" || word == "elseif") ? 'k' : 'w';
+    case 'f':
+        return word == "function" ? 'b' : (word == "for" || word == "false") ? 'k' : 'w';
+    case 'g':
+        return word == "goto" ? 'k' : 'w';
+    case 'i':
+        return word == "if" ? 'b' : word == "in" ? 'k' : 'w';
+    case 'l':
+        return word == "local" ? 'k' : 'w';
+    case 'n':
+        return (word == "nil" || word == "not") ? 'k' : 'w';
+    case 'o':
+        return word == "or" ? 'k' : 'w';
+    case 'r':
+        return word == "repeat" ? 'b' : word == "return" ? 'r' : 'w';
+    case 't':
+        return (word == "then" || word == "true") ? 'k' : 'w';
+    case 'u':
+        return word == "until" ? 'e' : 'w';
+    case 'w':
+        return word == "while" ? 'k' : 'w';
+    default:
+        return 'w';
+    }
+}
+
+static bool isAsciiIdentChar(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
+
+size_t BoundaryScanner::next(std::string_view text, size_t target) {
+    while (pos_ < text.size()) {
+        if (longLevel_ >= 0) {
+            std::string close = "]" + std::string(longLevel_, '=') + "]";
+            auto end          = text.find(close, pos_);
+            if (end == std::string_view::npos) {
+                // The closing bracket may be split between this text and the next one
+                pos_ = std::max(pos_, text.size() - std::min(text.size(), close.size() - 1));
+                return std::string_view::npos;
+            }
+            pos_       = end + close.size();
+            longLevel_ = -1;
+            continue;
+        }
+
+        char c = text[pos_];
+        if (c == '\n') {
+            cutStart_    = atLineStart_ ? cutStart_ : pos_ + 1;
+            pos_++;
+            atLineStart_ = true;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            while (++pos_ < text.size() && (text[pos_] == ' ' || text[pos_] == '\t')) {
+            }
+            continue;
+        }
+        if (c == '-' && pos_ + 1 < text.size() && text[pos_ + 1] == '-') {
+            int level = longBracketLevel(text, pos_ + 2);
+            if (level >= 0) {
+                longLevel_ = level;
+                pos_ += level + 4;
+            } else {
+                pos_ = std::min(text.find('\n', pos_), text.size());
+            }
+            continue;
+        }
+
+        size_t stringEnd = c == '"' || c == '\'' ? skipQuotedString(text, pos_) : 0;
+        if (stringEnd == text.size() && text.back() != c) {
+            // The string goes on after an escaped line break
+            return std::string_view::npos;
+        }
+
+        // A token, the fields rule is decided by what comes before it and the keyword rule by the token itself
+        size_t boundary = std::string_view::npos;
+        if (atLineStart_ && !brackets_.empty() && otherBrackets_ == 0 && brackets_.back().blockDepth == blockDepth_ && (prev_ == ',' || prev_ == ';')) {
+            boundary = cutStart_;
+        }
+        bool lineStart   = atLineStart_;
+        bool afterReturn = prevReturn_;
+        atLineStart_     = false;
+        prevReturn_      = false;
+
+        if (stringEnd > 0) {
+            pos_  = stringEnd;
+            prev_ = '"';
+        } else if (c == '[' && longBracketLevel(text, pos_) >= 0) {
+            longLevel_ = longBracketLevel(text, pos_);
+            pos_ += longLevel_ + 2;
+            prev_ = '"';
+        } else if (isAsciiIdentChar(c) || c == '$') {
+            bool number = c >= '0' && c <= '9';
+            size_t end  = pos_ + 1;
+            while (end < text.size() && (isAsciiIdentChar(text[end]) || (number && (text[end] == '.' || ((text[end] == '+' || text[end] == '-') && std::strchr("eEpP", text[end - 1])))))) {
+                end++;
+            }
+            char wordClass = scannerWordClass(text.substr(pos_, end - pos_));
+            pos_           = end;
+            prev_          = 'w';
+            if (wordClass == 'b') {
+                blockDepth_++;
+            } else if (wordClass == 'e') {
+                blockDepth_--;
+            } else if (wordClass == 'r') {
+                prevReturn_ = true;
+            } else if (wordClass == 'w') {
+                lineStart = false;
+            }
+            if (lineStart && brackets_.empty()) {
+                boundary = cutStart_;
+            }
+        } else {
+            pos_++;
+            if (c == '{' || c == '(' || c == '[') {
+                brackets_.push_back({c == '{' && (prev_ == '=' || afterReturn), blockDepth_});
+                otherBrackets_ += brackets_.back().fields ? 0 : 1;
+            } else if ((c == '}' || c == ')' || c == ']') && !brackets_.empty()) {
+                otherBrackets_ -= brackets_.back().fields ? 0 : 1;
+                brackets_.pop_back();
+            }
+            bool assign = c == '=' && !(pos_ < text.size() && text[pos_] == '=') && !(pos_ >= 2 && std::strchr("=<>~", text[pos_ - 2]));
+            prev_       = c == '=' && !assign ? '<' : c;
+        }
+
+        if (boundary != std::string_view::npos && boundary >= target) {
+            return boundary;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// Transforms a window of a file which has been cut at boundaries(see BoundaryScanner), only the first window has the directive line. `state`
+// comes from the window before and is replaced by the state after this one, the dependencies of the window are added to `result`.
+static std::string transformWindow(TransformerContext &ctx, const std::string &filename, std::string_view window, bool first, WindowState &state, TransformResult &result) {
+    int firstLine    = state.firstLine;
+    auto transformer = first ? std::make_unique<CustomLuaTransformer>(ctx, filename, window) : std::make_unique<CustomLuaTransformer>(ctx, filename, window, std::move(state));
+
+    // Unlike a whole file, a window without operator sites may still have a `--[[dense]]` annotation for the site of a later window
+    bool hasSites;
+    {
+        TraceSpan span("prescan", filename, window.size());
+        hasSites = hasExtendedSyntax(window) || window.find("--[[dense]]") != std::string_view::npos;
+    }
+    if (hasSites) {
+        {
+            TraceSpan span("tokenize", filename, window.size());
+            transformer->tokenize();
+        }
+        TraceSpan span("parse", filename, window.size());
+        transformer->parse(0);
+    }
+
+    result.deps.insert(result.deps.end(), transformer->includeDeps.begin(), transformer->includeDeps.end());
+    result.cacheable = result.cacheable && !transformer->hasCompTime;
+
+    std::string output;
+    {
+        TraceSpan span("output", filename);
+        output     = transformer->compact ? compactCode(transformer->output()) : transformer->output();
+        span.bytes = output.size();
+    }
+    state           = transformer->takeWindowState();
+    state.firstLine = firstLine + (int)std::count(window.begin(), window.end(), '\n');
+    return output;
+}
+
+// Intra-file parallel transform of the inputs of LJP_PARALLEL_SIZE bytes or more, e.g. huge generated modules. The input is cut at boundaries
+// (see BoundaryScanner) into segments of about LJ_PRO_PARALLEL_SEGMENT bytes or more, which are transformed by LJP_THREADS threads and joined
+// in order, so the output is the same as the output of a single transformer. The segments are independent but for two things:
+//   - `$comp_time` and `$include` run on the Lua state and the include graph of the calling thread, and the blocks of a file share their
+//     state. The input is also cut right before and after them, and these small segments are transformed in order on the calling thread,
+//     after the others.
+//   - A `--[[dense]]` annotation at the end of its segment applies to the first statement of the next one. This is rare, as
+//     the comment lines before a statement go with it, so the segments are transformed as if there was none, and a segment following such an
+//     annotation is transformed again on the calling thread.
+// Returns false if the input is not worth cutting, it is then transformed as a whole.
+static bool transformParallel(TransformerContext &ctx, const std::string &filename, std::string_view input, TransformResult &result) {
+    struct Segment {
+        std::string_view text;
+        int firstLine;
+        bool serial; // Has `$comp_time` or `$include`(or a `$` in a string or a comment)
+        std::string output;
+        TransformResult result;
+        bool pendingDense = false;
+    };
+
+    std::vector<Segment> segments;
+    {
+        TraceSpan span("split", filename, input.size());
+        size_t step = std::max<size_t>(LJ_PRO_PARALLEL_SEGMENT, input.size() / (ctx.threads * 4));
+        BoundaryScanner scanner;
+        size_t start  = 0;
+        size_t dollar = input.find('$');
+        std::vector<size_t> ends;
+        while (start < input.size()) {
+            size_t end;
+            if (dollar < start + step) {
+                // End the segment at the last boundary before the `$`, the next one goes on to the first boundary after it
+                size_t last = start;
+                while ((end = scanner.next(input, last + 1)) != std::string_view::npos && end <= dollar) {
+                    last = end;
+                }
+                if (last > start) {
+                    ends.push_back(last);
+                }
+            } else {
+                end = scanner.next(input, start + step);
+            }
+            start = std::min(end, input.size());
+            ends.push_back(start);
+            dollar = input.find('$', start);
+        }
+
+        int line = 1;
+        start    = 0;
+        for (size_t end : ends) {
+            auto text = input.substr(start, end - start);
+            segments.push_back({text, line, text.find('$') != std::string_view::npos, {}, {}, false});
+            line += (int)std::count(text.begin(), text.end(), '\n');
+            start = end;
+        }
+    }
+    if (segments.size() < 2) {
+        return false;
+    }
+
+    WindowState fileState = CustomLuaTransformer::directiveState(ctx, input.substr(0, input.find('\n')));
+    auto transformAt      = [&](size_t i, WindowState &state, TransformResult &segmentResult) {
+        auto &segment   = segments[i];
+        state.firstLine = segment.firstLine;
+        segment.output  = transformWindow(ctx, filename, segment.text, i == 0, state, segmentResult);
+    };
+
+    // The segments are handed out in order to the threads, the calling thread is one of them
+    std::atomic<size_t> nextSegment{0};
+    auto worker = [&]() {
+        for (size_t i = nextSegment++; i < segments.size(); i = nextSegment++) {
+            if (!segments[i].serial) {
+                WindowState state = fileState;
+                transformAt(i, state, segments[i].result);
+                segments[i].pendingDense = state.pendingDense;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(ctx.threads, segments.size()); i++) {
+        try {
+            threads.emplace_back(worker);
+        } catch (const std::system_error &) {
+            break; // Out of threads, the others do the work
+        }
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // The state of the file goes through the serial segments, the parallel ones only pass on a pending annotation
+    WindowState state = fileState;
+    size_t size       = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        auto &segment = segments[i];
+        if (segment.serial || state.pendingDense) {
+            TraceSpan span("serial", filename, segment.text.size());
+            segment.result = TransformResult();
+            transformAt(i, state, segment.result);
+        } else {
+            state.pendingDense = segment.pendingDense;
+        }
+        result.deps.insert(result.deps.end(), segment.result.deps.begin(), segment.result.deps.end());
+        result.cacheable = result.cacheable && segment.result.cacheable;
+        size += segment.output.size();
+    }
+    result.envDeps = state.envDeps;
+
+    TraceSpan span("join", filename, size);
+    result.output.reserve(size);
+    for (auto &segment : segments) {
+        result.output += segment.output;
+        std::string().swap(segment.output);
+    }
+    return true;
+}
+
+// Preprocess and transform a luajit-pro source without looking at any cache. The intermediate results are dumped to `dumpName` if LJP_KEEP_FILE is enabled.
+static TransformResult transformCode(TransformerContext &ctx, const std::string &filename, std::string_view source, bool disablePreprocess, const std::string &dumpName) {
+    TransformResult result;
+
+    // The outermost call owns the include graph of the load, the included files are transformed by nested calls
+    std::unique_ptr<IncludeGraph> graph;
+    if (ctx.includeGraph == nullptr) {
+        graph            = std::make_unique<IncludeGraph>(filename, source);
+        ctx.includeGraph = graph.get();
+    }
+
+    std::string processed;
+    std::string_view input = source;
+    if (disablePreprocess) {
+        std::cout << "[luajit-pro] preprocess is disabled in file: " << filename << std::endl;
+    } else {
+        TraceSpan span("preprocess", filename, source.size());
+        Preprocessor preprocessor(ctx.defines);
+        processed   = preprocessor.process(filename, source);
+        input       = processed;
+        result.deps = preprocessor.deps;
+    }
+
+    bool hasSites;
+    {
+        TraceSpan span("prescan", filename, input.size());
+        hasSites = hasExtendedSyntax(input);
+    }
+    if (!(hasSites && ctx.threads > 1 && input.size() >= ctx.parallelSize && transformParallel(ctx, filename, input, result))) {
+        CustomLuaTransformer transformer(ctx, filename, input);
+        if (hasSites) {
+            {
+                TraceSpan span("tokenize", filename, input.size());
+                transformer.tokenize();
+            }
+            TraceSpan span("parse", filename, input.size());
+            transformer.parse(0);
+        }
+        // transformer.dumpContentLines(false);
+
+        result.deps.insert(result.deps.end(), transformer.includeDeps.begin(), transformer.includeDeps.end());
+        result.envDeps = transformer.envDeps;
+        result.cacheable = !transformer.hasCompTime;
+
+        TraceSpan span("output", filename);
+        result.output = transformer.compact ? compactCode(transformer.output()) : transformer.output();
+        span.bytes    = result.output.size();
+    }
+
+    if (ctx.keepFile && !dumpName.empty()) {
+        // Only for debugging, the chunk is handed to LuaJIT from memory
+        std::ofstream(dumpName + ctx.proccessedSuffix, std::ios::trunc) << input;
+        std::ofstream(dumpName + ctx.transformedSuffix, std::ios::trunc) << result.output;
+    }
+
+    if (graph) {
+        ctx.includeGraph = nullptr;
+    }
+    return result;
+}
+
+static std::string absolutePath(const std::string &filename) { return std::filesystem::absolute(filename).lexically_normal().string(); }
+
+static bool isIncludeOnce(std::string_view source) { return directiveOption(source.substr(0, source.find('\n')), "include") == "once"; }
+
+// Puts the code on a single line, the comments are removed and the line breaks outside of strings become spaces
+std::string flattenCode(std::string_view code) {
+    std::string out;
+    out.reserve(code.size());
+    size_t pos = 0;
+    while (pos < code.size()) {
+        char c     = code[pos];
+        size_t end = pos;
+        if (c == '"' || c == '\'') {
+            end = skipQuotedString(code, pos);
+        } else if (c == '[' && longBracketLevel(code, pos) >= 0) {
+            end = skipLongBracket(code, pos, longBracketLevel(code, pos));
+        } else if (c == '-' && pos + 1 < code.size() && code[pos + 1] == '-') {
+            int level = longBracketLevel(code, pos + 2);
+            if (level >= 0) {
+                pos = skipLongBracket(code, pos + 2, level);
+            } else {
+                pos = std::min(code.find('\n', pos), code.size());
+            }
+            out += ' ';
+            continue;
+        }
+        if (end != pos) {
+            out.append(code, pos, end - pos);
+            pos = end;
+            continue;
+        }
+        out += (c == '\n' || c == '\r') ? ' ' : c;
+        pos++;
+    }
+    out += ' ';
+    return out;
+}
+
+// Whether a space is needed between two characters for them to stay in different tokens, e.g. `a b`, `- -`, `1 ..`, `[ [`, `= =`
+static bool needsSpace(char a, char b) {
+    if (isWordChar(a) && isWordChar(b)) {
+        return true;
+    }
+    return (a == '-' && b == '-') || a == '.' || b == '.' || (a == '[' && (b == '[' || b == '=')) || (b == '=' && std::strchr("=<>~", a)) || (a == ':' && b == ':');
+}
+
+// Compact emission: the comments and the indentation are removed and the other whitespace is collapsed, but every line break outside of
+// strings is kept. The lines of the output are the lines of the source, so the debug info of LuaJIT needs no line map.
+std::string compactCode(std::string_view code) {
+    std::string out;
+    out.reserve(code.size());
+    bool space = false; // Whitespace or a comment has been skipped since the last token
+    auto emit  = [&](std::string_view text) {
+        if (space && !out.empty() && out.back() != '\n' && needsSpace(out.back(), text[0])) {
+            out += ' ';
+        }
+        space = false;
+        out.append(text);
+    };
+
+    size_t pos = 0;
+    while (pos < code.size()) {
+        char c     = code[pos];
+        size_t end = pos + 1;
+        if (c == '"' || c == '\'') {
+            end = skipQuotedString(code, pos);
+        } else if (c == '[' && longBracketLevel(code, pos) >= 0) {
+            end = skipLongBracket(code, pos, longBracketLevel(code, pos));
+        } else if (c == '-' && pos + 1 < code.size() && code[pos + 1] == '-') {
+            int level = longBracketLevel(code, pos + 2);
+            if (level >= 0) {
+                end = skipLongBracket(code, pos + 2, level);
+                out.append(std::count(code.begin() + pos, code.begin() + end, '\n'), '\n');
+            } else {
+                end = std::min(code.find('\n', pos), code.size());
+            }
+            space = true;
+            pos   = end;
+            continue;
+        } else if (c == '\n') {
+            out += '\n';
+            space = false;
+            pos++;
+            continue;
+        } else if (std::isspace((unsigned char)c)) {
+            space = true;
+            pos++;
+            continue;
+        }
+        emit(code.substr(pos, end - pos));
+        pos = end;
+    }
+    return out;
+}
+
+IncludeGraph::IncludeGraph(const std::string &rootFile, std::string_view rootSource) {
+    stack_.push_back(absolutePath(rootFile));
+    if (isIncludeOnce(rootSource)) {
+        included_.insert(stack_.back());
+    }
+}
+
+// Same as package.searchpath(), which the `$include`s used to run in the Lua state one by one
+std::string IncludeGraph::resolve(TransformerContext &ctx, const std::string &package, const std::string &codeName) {
+    // The module name is usually a plain string literal, anything else is evaluated by Lua
+    std::string name;
+    if (package.size() >= 2 && (package[0] == '"' || package[0] == '\'') && package.back() == package[0] && package.find_first_of("\\\n", 1) == std::string::npos && package.find(package[0], 1) == package.size() - 1) {
+        name = package.substr(1, package.size() - 2);
+    } else {
+        name = ctx.luaDoString(codeName.c_str(), ("return " + package).c_str());
+    }
+
+    auto it = resolved_.find(name);
+    if (it != resolved_.end()) {
+        return it->second;
+    }
+
+    // A `$comp_time` block may change package.path, only the blocks before the first `$include` of a load are taken into account
+    if (!hasPackagePath_) {
+        packagePath_    = ctx.luaDoString(codeName.c_str(), "return package.path");
+        hasPackagePath_ = true;
+    }
+
+    std::string module = name;
+    std::replace(module.begin(), module.end(), '.', '/');
+    std::string tried;
+    size_t start = 0;
+    while (start <= packagePath_.size()) {
+        size_t end = std::min(packagePath_.find(';', start), packagePath_.size());
+        std::string file(packagePath_, start, end - start);
+        start = end + 1;
+        if (file.empty()) {
+            continue;
+        }
+        for (size_t mark = file.find('?'); mark != std::string::npos; mark = file.find('?', mark + module.size())) {
+            file.replace(mark, 1, module);
+        }
+        if (access(file.c_str(), R_OK) == 0) {
+            return resolved_[name] = file;
+        }
+        tried += "\n\tno file '" + file + "'";
+    }
+
+    std::cerr << "[luajit-pro] " << codeName << ": module '" << name << "' not found:" << tried << std::endl;
+    ASSERT(false, "Cannot find the included module!");
+    return "";
+}
+
+bool IncludeGraph::include(TransformerContext &ctx, const std::string &filename, IncludeNode &node) {
+    std::string path = absolutePath(filename);
+    if (included_.count(path)) {
+        return false;
+    }
+    auto it = nodes_.find(path);
+    if (it != nodes_.end()) {
+        node = it->second;
+        return true;
+    }
+    if (std::find(stack_.begin(), stack_.end(), path) != stack_.end()) {
+        std::string cycle;
+        for (auto file = std::find(stack_.begin(), stack_.end(), path); file != stack_.end(); ++file) {
+            cycle += *file + " -> ";
+        }
+        std::cerr << "[luajit-pro] Include cycle: " << cycle << path << std::endl;
+        ASSERT(false, "Include cycle!");
+    }
+
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        std::cerr << "[luajit-pro] Cannot open file: " << filename << std::endl;
+        ASSERT(false, "Cannot open file!");
+    }
+
+    bool disablePreprocess;
+    node.once = isIncludeOnce(file.view());
+    if (node.once) {
+        included_.insert(path);
+    }
+    size_t includedBefore = included_.size();
+
+    stack_.push_back(path);
+    if (parseDirective(file.view(), disablePreprocess)) {
+        node.result = transformCode(ctx, filename, file.view(), disablePreprocess, ctx.cacheDir + "/" + std::filesystem::path(filename).filename().string());
+    } else {
+        node.result.output = std::string(file.view());
+    }
+    stack_.pop_back();
+
+    node.code = flattenCode(node.result.output);
+    node.result.output.clear();
+
+    // The expansion can not be reused if it has expanded an "include: once" file, the next expansion will skip that file
+    if (!node.once && included_.size() == includedBefore) {
+        nodes_.emplace(path, node);
+    }
+    return true;
+}
+
+// See validateManifest()
+static std::string buildManifest(const TransformResult &result) {
+    std::string manifest;
+    std::unordered_set<std::string> seen;
+    for (const auto &dep : result.deps) {
+        if (seen.insert(dep).second) {
+            manifest += hashFile(dep) + " " + dep + "\n";
+        }
+    }
+    for (const auto &name : result.envDeps) {
+        manifest += "env " + hashEnv(name) + " " + name + "\n";
+    }
+    return manifest;
+}
+
+TransformResult transformSource(TransformerContext &ctx, const std::string &filename, std::string_view source) {
+    TransformResult result;
+
+    // std::cout << "[Debug] inputFile => " << filename << std::endl;
+
+    bool disablePreprocess;
+    if (!parseDirective(source, disablePreprocess)) {
+        // std::cout << "[luajit-pro] File: "<< filename << " does not contain the required comment: \"--[[luajit-pro]]\" at the first line." << std::endl;
+        result.output = std::string(source);
+        return result;
+    }
+
+    std::string newFileName  = ctx.cacheDir + "/" + std::filesystem::path(filename).filename().string();
+    std::string entry        = cacheEntry(ctx, filename, source);
+    std::string cachedFile   = entry + ".lua";
+    std::string manifestFile = entry + ".deps";
+    if (ctx.cacheEnabled) {
+        TraceSpan span("cache_lookup", filename, source.size());
+        if (validateManifest(manifestFile, result.deps, result.envDeps) && readFile(cachedFile, result.output)) {
+            span.bytes = result.output.size();
+            return result;
+        }
+    }
+
+    result = transformCode(ctx, filename, source, disablePreprocess, newFileName);
+
+    if (ctx.cacheEnabled && result.cacheable) {
+        TraceSpan span("cache_write", filename, result.output.size());
+        // The manifest is written last, an entry without a manifest is never used
+        if (writeFileAtomic(cachedFile, result.output)) {
+            writeFileAtomic(manifestFile, buildManifest(result));
+        }
+    }
+
+    return result;
+}
+
+// Streaming transform of the files of LJP_STREAM_SIZE bytes or more(e.g. generated data modules), the output is handed to the LuaJIT parser
+// window by window instead of at once. The source is preprocessed a few lines at a time and cut at the first boundary(see BoundaryScanner)
+// after LJ_PRO_STREAM_WINDOW bytes, and every window is transformed by its own transformer, which takes over the state of the file from the
+// transformer of the window before. The source itself is a memory mapping of the file(see source_map(), lj_load.c only falls back to reading
+// it into a buffer if the file can not be mapped, e.g. a pipe), so its pages come from the page cache and can be dropped again once they have
+// been streamed, and the memory used by the transform is bounded by the size of a window instead of a few times the size of the file. The
+// output is the same as the output of transformCode(). It is written to the transform cache as it goes, and the entry is only committed once
+// the whole file has been streamed. A cached file is served from a memory mapping of the cache entry.
+class TransformStream {
+  public:
+    // Returns nullptr if the file is not streamed
+    static std::unique_ptr<TransformStream> open(TransformerContext &ctx, const std::string &filename, std::string_view source);
+
+    TransformStream(TransformerContext &ctx, const std::string &filename, std::string_view source, const std::string &entry);
+    ~TransformStream();
+
+    TransformStream(const TransformStream &)            = delete;
+    TransformStream &operator=(const TransformStream &) = delete;
+
+    // Returns the next piece of the output, which is valid until the next call, or an empty view at the end
+    std::string_view next();
+
+  private:
+    TransformerContext &ctx_;
+    std::string filename_;
+    std::string_view source_;
+    std::string entry_;
+    std::unique_ptr<MappedFile> cached_; // The output comes from the transform cache
+
+    bool disablePreprocess_ = false;
+    Preprocessor preprocessor_;
+    size_t sourcePos_ = 0; // The source lines consumed without preprocessing
+    bool started_     = false;
+    bool ended_       = false;
+    bool done_        = false;
+
+    std::string pending_; // Preprocessed and not transformed yet
+    BoundaryScanner scanner_;
+    bool firstWindow_ = true;
+    WindowState state_;
+    std::unique_ptr<IncludeGraph> graph_;
+    TransformResult result_; // Everything but the output
+    std::string output_;
+
+    std::string tmpFile_; // The cache entry being written
+    std::ofstream cacheOut_;
+    std::ofstream processedDump_;
+    std::ofstream transformedDump_;
+
+    void start();
+    bool readMore();
+    void streamWindow(std::string_view window);
+    void finish();
+};
+
+std::unique_ptr<TransformStream> TransformStream::open(TransformerContext &ctx, const std::string &filename, std::string_view source) {
+    bool disablePreprocess;
+    if (ctx.streamSize == 0 || source.size() < ctx.streamSize || !ctx.serverSocket.empty() || !parseDirective(source, disablePreprocess)) {
+        return nullptr;
+    }
+
+    std::string entry = cacheEntry(ctx, filename, source);
+    auto stream       = std::make_unique<TransformStream>(ctx, filename, source, entry);
+    if (ctx.cacheEnabled) {
+        TraceSpan span("cache_lookup", filename, source.size());
+        std::vector<std::string> deps;
+        std::vector<std::string> envDeps;
+        if (validateManifest(entry + ".deps", deps, envDeps)) {
+            auto cached = std::make_unique<MappedFile>(entry + ".lua");
+            if (cached->isOpen()) {
+                span.bytes      = cached->view().size();
+                stream->cached_ = std::move(cached);
+            }
+        }
+    }
+    return stream;
+}
+
+TransformStream::TransformStream(TransformerContext &ctx, const std::string &filename, std::string_view source, const std::string &entry) : ctx_(ctx), filename_(filename), source_(source), entry_(entry), preprocessor_(ctx.defines) {
+    parseDirective(source, disablePreprocess_);
+}
+
+TransformStream::~TransformStream() {
+    if (!tmpFile_.empty()) {
+        // The stream has been abandoned, e.g. on a syntax error in the LuaJIT parser
+        cacheOut_.close();
+        std::remove(tmpFile_.c_str());
+    }
+}
+
+std::string_view TransformStream::next() {
+    if (done_) {
+        return {};
+    }
+    if (cached_) {
+        done_ = true;
+        return cached_->view();
+    }
+    if (!started_) {
+        start();
+    }
+
+    output_.clear();
+    while (output_.empty() && !done_) {
+        size_t cut = scanner_.next(pending_, LJ_PRO_STREAM_WINDOW);
+        while (cut == std::string_view::npos && readMore()) {
+            cut = scanner_.next(pending_, LJ_PRO_STREAM_WINDOW);
+        }
+        size_t size = cut == std::string_view::npos ? pending_.size() : cut;
+
+        if (size > 0) {
+            streamWindow(std::string_view(pending_).substr(0, size));
+        }
+        pending_.erase(0, size);
+        scanner_.consume(size);
+        if (cut == std::string_view::npos) {
+            finish();
+        }
+    }
+    return output_;
+}
+
+void TransformStream::start() {
+    started_ = true;
+    if (disablePreprocess_) {
+        std::cout << "[luajit-pro] preprocess is disabled in file: " << filename_ << std::endl;
+    } else {
+        preprocessor_.begin(filename_, source_);
+    }
+    graph_ = std::make_unique<IncludeGraph>(filename_, source_);
+    if (ctx_.cacheEnabled) {
+        tmpFile_ = entry_ + ".lua.tmp." + std::to_string((int)getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        cacheOut_.open(tmpFile_, std::ios::binary | std::ios::trunc);
+    }
+    if (ctx_.keepFile) {
+        // Only for debugging, like transformCode()
+        std::string dumpName = ctx_.cacheDir + "/" + std::filesystem::path(filename_).filename().string();
+        processedDump_.open(dumpName + ctx_.proccessedSuffix, std::ios::trunc);
+        transformedDump_.open(dumpName + ctx_.transformedSuffix, std::ios::trunc);
+    }
+}
+
+// Appends the next lines of the source to the pending text, returns false if the source has ended
+bool TransformStream::readMore() {
+    if (ended_) {
+        return false;
+    }
+    if (disablePreprocess_) {
+        size_t end = std::min(source_.size(), sourcePos_ + LJ_PRO_STREAM_WINDOW);
+        end        = std::min(source_.find('\n', end), source_.size() - 1) + 1;
+        pending_.append(source_.substr(sourcePos_, end - sourcePos_));
+        sourcePos_ = end;
+        ended_     = sourcePos_ >= source_.size();
+    } else {
+        TraceSpan span("preprocess", filename_, pending_.size());
+        size_t size = pending_.size();
+        ended_      = !preprocessor_.read(LJ_PRO_STREAM_WINDOW, pending_);
+        span.bytes  = pending_.size() - size;
+    }
+    return true;
+}
+
+void TransformStream::streamWindow(std::string_view window) {
+    ctx_.includeGraph = graph_.get();
+    output_           = transformWindow(ctx_, filename_, window, firstWindow_, state_, result_);
+    firstWindow_      = false;
+    ctx_.includeGraph = nullptr;
+
+    if (cacheOut_.is_open()) {
+        cacheOut_.write(output_.data(), output_.size());
+    }
+    if (ctx_.keepFile) {
+        processedDump_ << window;
+        transformedDump_ << output_;
+    }
+}
+
+// Commits the cache entry once the whole output has been produced
+void TransformStream::finish() {
+    done_ = true;
+    if (!disablePreprocess_) {
+        result_.deps.insert(result_.deps.begin(), preprocessor_.deps.begin(), preprocessor_.deps.end());
+    }
+    result_.envDeps = state_.envDeps;
+    if (tmpFile_.empty()) {
+        return;
+    }
+
+    cacheOut_.close();
+    std::error_code ec;
+    if (result_.cacheable && !cacheOut_.fail()) {
+        TraceSpan span("cache_write", filename_);
+        std::filesystem::rename(tmpFile_, entry_ + ".lua", ec);
+        if (!ec) {
+            writeFileAtomic(entry_ + ".deps", buildManifest(result_));
+            tmpFile_.clear();
             return;
         }
     }
+    std::remove(tmpFile_.c_str());
+    tmpFile_.clear();
+}
 
-    // compTimeToken [ "(" <compTimeName> ")" ] leftBracketToken <compTimeContent> rightBracketToken
-    Token compTimeToken = tokenVec.at(_idx);
-    Token compTimeNameOpt;
-    Token leftBracketToken;
-    Token rightBracketToken;
-    if (processedTokenLines.count(compTimeToken.startLine) > 0 && processedTokenColumns.count(compTimeToken.startColumn) > 0) {
+const TransformResult *StringCache::find(uint64_t key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+
+    auto entry = it->second;
+    for (size_t i = 0; i < entry->result.deps.size(); i++) {
+        if (hashFile(entry->result.deps[i]) != entry->depHashes[i]) {
+            // One of the included files has changed
+            entries_.erase(entry);
+            index_.erase(it);
+            return nullptr;
+        }
+    }
+    for (size_t i = 0; i < entry->result.envDeps.size(); i++) {
+        if (hashEnv(entry->result.envDeps[i]) != entry->envHashes[i]) {
+            entries_.erase(entry);
+            index_.erase(it);
+            return nullptr;
+        }
+    }
+
+    entries_.splice(entries_.begin(), entries_, entry);
+    return &entry->result;
+}
+
+void StringCache::insert(uint64_t key, const TransformResult &result) {
+    if (capacity == 0 || index_.count(key)) {
         return;
     }
 
-    if (tokenVec.at(_idx + 1).data == "(") {
-        compTimeNameOpt = tokenVec.at(_idx + 2);
-        ASSERT(tokenVec.at(_idx + 3).data == ")");
-        _idx = _idx + 3;
-    } else {
-        compTimeNameOpt.data = "Unknown";
+    Entry entry{key, result, {}, {}};
+    for (const auto &dep : result.deps) {
+        entry.depHashes.push_back(hashFile(dep));
     }
+    for (const auto &name : result.envDeps) {
+        entry.envHashes.push_back(hashEnv(name));
+    }
+    entries_.push_front(std::move(entry));
+    index_[key] = entries_.begin();
 
-    _idx++;
-    ASSERT(tokenVec.at(_idx).data == "{");
-    leftBracketToken = tokenVec.at(_idx);
+    if (entries_.size() > capacity) {
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+    }
+}
 
-    _idx++;
-    bracketCnt++;
+// Transform a buffer passed to load()/loadstring()/luaL_loadbufferx(). The result is only cached in memory, there is no file to key a disk cache on.
+TransformResult transformBuffer(TransformerContext &ctx, const std::string &name, std::string_view source) {
+    bool disablePreprocess;
+    if (!parseDirective(source, disablePreprocess)) {
+        TransformResult result;
+        result.output = std::string(source);
+        return result;
+    }
 
-    while (bracketCnt != 0) {
-        auto token = tokenVec.at(_idx);
+    uint64_t key = hashString(LJ_PRO_VERSION);
+    for (const auto &define : ctx.defines) {
+        key = hashString(define, key);
+    }
+    // The name is part of the output: `#include` is resolved relative to it and `__FILE__` expands to it
+    key = hashString(name, key);
+    key = hashString(source, key);
 
-        if (token.data == "{") {
-            bracketCnt++;
-        } else if (token.data == "}") {
-            bracketCnt--;
+    if (ctx.cacheEnabled) {
+        if (auto cached = ctx.stringCache.find(key)) {
+            return *cached;
         }
+    }
 
-        _idx++;
+    auto result = transformCode(ctx, name, source, disablePreprocess, "");
+    if (ctx.cacheEnabled && result.cacheable) {
+        ctx.stringCache.insert(key, result);
+    }
+    return result;
+}
+
+static std::string jsonEscape(const std::string &str) {
+    std::string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
     }
-    rightBracketToken = tokenVec.at(_idx - 1);
-    ASSERT(rightBracketToken.data == "}");
+    return escaped;
+}
 
-    processedTokenLines.insert(compTimeToken.startLine);
-    processedTokenColumns.insert(compTimeToken.startColumn);
+Tracer::Tracer() {
+    const char *value = std::getenv("LJP_TRACE");
+    if (value == nullptr || value[0] == '\0') {
+        return;
+    }
+    std::string path = value;
+    auto pid         = path.find("%p");
+    if (pid != std::string::npos) {
+        path.replace(pid, 2, std::to_string((int)getpid()));
+    }
+    file_ = fopen(path.c_str(), "w");
+    if (file_ == nullptr) {
+        std::cout << "[luajit-pro] Failed to open the trace file: " << path << std::endl;
+        return;
+    }
+    std::cout << "[luajit-pro] LJP_TRACE is enabled: " << path << std::endl;
+    fputs("[\n", file_);
+}
 
-    std::string compTimeContent = getContentBetween(leftBracketToken, rightBracketToken);
-    std::string luaCode         = luaDoString(std::string(filename_ + "/compTime/" + compTimeNameOpt.data + ":" + std::to_string(compTimeToken.startLine)).c_str(), compTimeContent.c_str());
+Tracer::~Tracer() {
+    if (file_ != nullptr) {
+        // The array format does not need the closing bracket, it is only there for strict JSON parsers
+        fprintf(file_, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"luajit-pro\"}}\n]\n", (int)getpid());
+        fclose(file_);
+    }
+}
 
-    if (replacedTokenLines.count(compTimeToken.startLine) > 0 && replacedTokenColumns.count(compTimeToken.startColumn) > 0) {
+void Tracer::span(const std::string &name, const std::string &file, size_t bytes, uint64_t start) {
+    uint64_t end = now();
+    auto sink    = sink_.load(std::memory_order_relaxed);
+    if (sink != nullptr) {
+        sink(name.c_str(), file.c_str(), bytes, start, end);
+    }
+    if (file_ == nullptr) {
         return;
-    } else {
-        replacedTokenLines.insert(compTimeToken.startLine);
-        replacedTokenColumns.insert(compTimeToken.startColumn);
     }
 
-    for (int i = compTimeToken.startLine; i <= rightBracketToken.startLine; i++) {
-        oldContentLines[i - 1] = "--[[line keeper]] ";
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    thread_local int tid = 0;
+    if (tid == 0) {
+        tid = nextTid_++;
     }
-    oldContentLines[compTimeToken.startLine - 1] = "--[[comp_time]] ";
-    oldContentLines[leftBracketToken.startLine - 1] += luaCode;
+    fprintf(file_, "{\"name\":\"%s\",\"cat\":\"luajit-pro\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"file\":\"%s\",\"bytes\":%zu,\"peak_rss_kb\":%ld}},\n", jsonEscape(name).c_str(),
+            (unsigned long long)start, (unsigned long long)(end - start), (int)getpid(), tid, jsonEscape(file).c_str(), bytes, usage.ru_maxrss);
+    fflush(file_);
 }
 
-void CustomLuaTransformer::parseInclude(int idx) {
-    int bracketCnt = 0;
-    int _idx       = idx;
+TransformerContext::TransformerContext(LuaDoStringPtr func) : luaDoString(func) {
+    {
+        const char *value = std::getenv("LJP_KEEP_FILE");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_KEEP_FILE is enabled" << std::endl;
+            keepFile = true;
+        }
+    }
 
-    while (tokenVec.at(_idx).kind != TokenKind::Include) {
-        _idx++;
-        if (tokenVec.at(_idx).kind == TokenKind::EndOfFile) {
-            return;
+    {
+        const char *value = std::getenv("LJP_WITH_PID_SUFFIX");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_WITH_PID_SUFFIX is enabled" << std::endl;
+            proccessedSuffix  = proccessedSuffix + "." + std::to_string((int)getpid());
+            transformedSuffix = transformedSuffix + "." + std::to_string((int)getpid());
         }
     }
 
-    Token includeToken = tokenVec.at(_idx);
-    Token leftBracketToken;
-    Token rightBracketToken;
+    {
+        const char *value = std::getenv("LJP_NO_CACHE");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_NO_CACHE is enabled" << std::endl;
+            cacheEnabled = false;
+        }
+    }
 
-    if (processedTokenLines.count(includeToken.startLine) > 0 && processedTokenColumns.count(includeToken.startColumn) > 0) {
-        return;
+    {
+        const char *value = std::getenv("LJP_BC_CACHE");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_BC_CACHE is enabled" << std::endl;
+            bytecodeCacheEnabled = true;
+        }
     }
 
-    _idx++;
-    leftBracketToken = tokenVec.at(_idx);
-    ASSERT(leftBracketToken.data == "(");
+    {
+        const char *value = std::getenv("LJP_COMPTIME_CACHE");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_COMPTIME_CACHE is enabled" << std::endl;
+            compTimeCacheEnabled = true;
+        }
+    }
 
-    _idx++;
-    bracketCnt++;
-    while (bracketCnt != 0) {
-        auto token = tokenVec.at(_idx);
+    {
+        const char *value = std::getenv("LJP_COMPACT");
+        if (value != nullptr && strcmp(value, "1") == 0) {
+            std::cout << "[luajit-pro] LJP_COMPACT is enabled" << std::endl;
+            compact = true;
+        }
+    }
 
-        if (token.data == "(") {
-            bracketCnt++;
-        } else if (token.data == ")") {
-            bracketCnt--;
+    {
+        const char *value = std::getenv("LJP_SERVER");
+        if (value != nullptr && value[0] != '\0') {
+            serverSocket = value;
         }
+    }
 
-        _idx++;
+    {
+        const char *value = std::getenv("LJP_STREAM_SIZE");
+        if (value != nullptr) {
+            streamSize = std::strtoull(value, nullptr, 10);
+        }
     }
 
-    rightBracketToken = tokenVec.at(_idx - 1);
-    ASSERT(rightBracketToken.data == ")");
-    ASSERT(leftBracketToken.startLine == rightBracketToken.startLine);
+    {
+        const char *value = std::getenv("LJP_PARALLEL_SIZE");
+        if (value != nullptr) {
+            parallelSize = std::strtoull(value, nullptr, 10);
+        }
+    }
+
+    {
+        const char *value = std::getenv("LJP_THREADS");
+        if (value != nullptr) {
+            threads = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        } else {
+            threads = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+        }
+    }
 
-    processedTokenLines.insert(includeToken.startLine);
-    processedTokenColumns.insert(includeToken.startColumn);
+    {
+        const char *value = std::getenv("LJP_STRING_CACHE_SIZE");
+        if (value != nullptr) {
+            stringCache.capacity = std::strtoul(value, nullptr, 10);
+        }
+    }
 
-    std::string includePackage = getContentBetween(leftBracketToken, rightBracketToken);
+    {
+        // Extra macros for the preprocessor, e.g. LJP_DEFINES="DEBUG LEVEL=2"
+        const char *value = std::getenv("LJP_DEFINES");
+        if (value != nullptr) {
+            std::stringstream ss(value);
+            std::string define;
+            while (ss >> define) {
+                defines.push_back(define);
+            }
+        }
+    }
 
-    std::string luaCode = std::string("return assert(package.searchpath(") + includePackage + ", package.path))";
-    auto includeFile    = luaDoString(std::string(filename_ + "/include" + ":" + std::to_string(includeToken.startLine)).c_str(), luaCode.c_str());
+    if (cacheEnabled || keepFile) {
+        // The cache directory is optional, e.g. it can not be created on a read-only filesystem
+        std::error_code ec;
+        std::filesystem::create_directories(cacheDir, ec);
+        if (ec) {
+            std::cout << "[luajit-pro] Failed to create " << cacheDir << ", cache is disabled: " << ec.message() << std::endl;
+            cacheEnabled         = false;
+            bytecodeCacheEnabled = false;
+            keepFile             = false;
+        }
+    }
+}
 
-    std::ifstream file(file_transform(includeFile, luaDoString));
-    std::string includeContent = "";
+// Module archive: many transformed modules(Lua code or bytecode) packed into a single file, which is mapped into memory and shared by all the
+// threads and, through the page cache, by all the processes using it. The module names are looked up in an open addressing hash table at the
+// front of the file, so a `require` served by the archive costs no filesystem access at all.
+//
+//   ArchiveHeader
+//   uint32_t slots[numSlots]       Index of the entry + 1, 0 for an empty slot, probed linearly from hashString(name) % numSlots
+//   ArchiveEntry entries[numEntries]
+//   names, chunk names(both '\0' terminated) and data, referenced by their offsets from the start of the file
+#define LJ_PRO_ARCHIVE_MAGIC "LJPARC01"
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t numEntries;
+    uint32_t numSlots; // A power of two larger than numEntries
+};
 
-    if (file.is_open()) {
-        std::string line;
-        while (std::getline(file, line)) {
+struct ArchiveEntry {
+    uint64_t hash;
+    uint64_t nameOffset;
+    uint64_t chunknameOffset;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+};
 
-            // Regular expressions for Lua comments
-            std::regex singleLineComment(R"(--[^\n]*)");
-            std::regex multiLineComment(R"(--\[\[[\s\S]*?\]\])");
-            std::string result = line;
+class ModuleArchive {
+  public:
+    explicit ModuleArchive(const std::string &filename) : file_(filename), filename_(filename) {}
 
-            // Replace multi-line comments
-            auto multiLineBegin = std::sregex_iterator(result.begin(), result.end(), multiLineComment);
-            auto multiLineEnd   = std::sregex_iterator();
+    // Checks the header and the tables, the entries are checked when they are found
+    bool isValid() const {
+        auto data = file_.view();
+        if (data.size() < sizeof(ArchiveHeader)) {
+            return false;
+        }
+        auto header = (const ArchiveHeader *)data.data();
+        return memcmp(header->magic, LJ_PRO_ARCHIVE_MAGIC, 8) == 0 && header->numSlots > header->numEntries && (header->numSlots & (header->numSlots - 1)) == 0 &&
+               sizeof(ArchiveHeader) + header->numSlots * sizeof(uint32_t) + (uint64_t)header->numEntries * sizeof(ArchiveEntry) <= data.size();
+    }
 
-            for (std::sregex_iterator i = multiLineBegin; i != multiLineEnd; ++i) {
-                result.replace(i->position(), i->length(), "");
+    const std::string &filename() const { return filename_; }
+    size_t size() const { return ((const ArchiveHeader *)file_.view().data())->numEntries; }
+
+    const ArchiveEntry *find(std::string_view name, const char *&chunkname, std::string_view &code) const {
+        auto data    = file_.view();
+        auto header  = (const ArchiveHeader *)data.data();
+        auto slots   = (const uint32_t *)(data.data() + sizeof(ArchiveHeader));
+        auto entries = (const ArchiveEntry *)(slots + header->numSlots);
+
+        // A broken archive may have no empty slot, so a lookup probes every slot at most once. The chunk name is passed to lua_loadx as a C
+        // string, it must end in the file.
+        uint64_t hash = hashString(name);
+        uint32_t slot = hash & (header->numSlots - 1);
+        for (uint32_t probes = 0; probes < header->numSlots; probes++, slot = (slot + 1) & (header->numSlots - 1)) {
+            if (slots[slot] == 0 || slots[slot] > header->numEntries) {
+                return nullptr;
             }
+            auto entry = &entries[slots[slot] - 1];
+            if (entry->hash != hash || entry->nameOffset >= data.size() || entry->chunknameOffset >= data.size() || entry->dataOffset > data.size() || entry->dataSize > data.size() - entry->dataOffset ||
+                strnlen(data.data() + entry->chunknameOffset, data.size() - entry->chunknameOffset) == data.size() - entry->chunknameOffset) {
+                continue;
+            }
+            auto entryName = data.data() + entry->nameOffset;
+            if (strnlen(entryName, data.size() - entry->nameOffset) == name.size() && name == std::string_view(entryName, name.size())) {
+                chunkname = data.data() + entry->chunknameOffset;
+                code      = data.substr(entry->dataOffset, entry->dataSize);
+                return entry;
+            }
+        }
+        return nullptr;
+    }
 
-            // Replace single-line comments
-            auto singleLineBegin = std::sregex_iterator(result.begin(), result.end(), singleLineComment);
-            auto singleLineEnd   = std::sregex_iterator();
+  private:
+    MappedFile file_;
+    std::string filename_;
+};
 
-            for (std::sregex_iterator i = singleLineBegin; i != singleLineEnd; ++i) {
-                result.replace(i->position(), i->length(), "");
+// The archives of LJP_ARCHIVE(separated by ':'), searched in order. They are opened once per process, the first use comes from lj_load.c.
+static const std::vector<std::unique_ptr<ModuleArchive>> &moduleArchives() {
+    static const auto archives = [] {
+        std::vector<std::unique_ptr<ModuleArchive>> archives;
+        const char *value = std::getenv("LJP_ARCHIVE");
+        if (value == nullptr) {
+            return archives;
+        }
+        std::stringstream ss(value);
+        std::string filename;
+        while (std::getline(ss, filename, ':')) {
+            if (filename.empty()) {
+                continue;
             }
-
-            includeContent += result + " ";
+            auto archive = std::make_unique<ModuleArchive>(filename);
+            if (!archive->isValid()) {
+                std::cout << "[luajit-pro] Invalid module archive, it is ignored: " << filename << std::endl;
+                continue;
+            }
+            std::cout << "[luajit-pro] LJP_ARCHIVE is enabled: " << filename << "(" << archive->size() << " modules)" << std::endl;
+            archives.push_back(std::move(archive));
         }
+        return archives;
+    }();
+    return archives;
+}
 
-        file.close();
-    } else {
-        std::cerr << "Unable to open file" << std::endl;
-        ASSERT(false);
+bool writeArchive(const std::string &filename, const std::vector<std::string_view> &names, const std::vector<std::string_view> &chunknames, const std::vector<std::string_view> &data) {
+    uint32_t numSlots = 1;
+    while (numSlots <= names.size() * 2) {
+        numSlots *= 2;
     }
 
-    if (replacedTokenLines.count(includeToken.startLine) > 0 && replacedTokenColumns.count(includeToken.startColumn) > 0) {
-        return;
-    } else {
-        replacedTokenLines.insert(includeToken.startLine);
-        replacedTokenColumns.insert(includeToken.startColumn);
+    ArchiveHeader header;
+    memcpy(header.magic, LJ_PRO_ARCHIVE_MAGIC, 8);
+    header.numEntries = (uint32_t)names.size();
+    header.numSlots   = numSlots;
+
+    std::vector<uint32_t> slots(numSlots, 0);
+    std::vector<ArchiveEntry> entries(names.size());
+    std::string blob;
+    uint64_t blobOffset = sizeof(ArchiveHeader) + numSlots * sizeof(uint32_t) + entries.size() * sizeof(ArchiveEntry);
+    for (size_t i = 0; i < names.size(); i++) {
+        auto &entry = entries[i];
+        entry.hash  = hashString(names[i]);
+        uint32_t slot = entry.hash & (numSlots - 1);
+        while (slots[slot] != 0) {
+            auto &other = entries[slots[slot] - 1];
+            if (other.hash == entry.hash && names[slots[slot] - 1] == names[i]) {
+                std::cerr << "[luajit-pro] Duplicate module in the archive: " << names[i] << std::endl;
+                return false;
+            }
+            slot = (slot + 1) & (numSlots - 1);
+        }
+        slots[slot] = (uint32_t)i + 1;
+
+        entry.nameOffset = blobOffset + blob.size();
+        blob.append(names[i]).push_back('\0');
+        entry.chunknameOffset = blobOffset + blob.size();
+        blob.append(chunknames[i]).push_back('\0');
+        entry.dataOffset = blobOffset + blob.size();
+        entry.dataSize   = data[i].size();
+        blob.append(data[i]);
     }
 
-    // TODO: do file transform in the include file
-    if (leftBracketToken.startLine == rightBracketToken.startLine) {
-        oldContentLines[leftBracketToken.startLine - 1] = includeContent;
-    } else {
-        for (int i = includeToken.startLine; i <= rightBracketToken.startLine; i++) {
-            if (i == includeToken.startLine) {
-                oldContentLines[i - 1] = includeContent;
-            } else {
-                oldContentLines[i - 1] = "--[[line keeper]]";
+    std::string content;
+    content.reserve(blobOffset + blob.size());
+    content.append((const char *)&header, sizeof(header));
+    content.append((const char *)slots.data(), slots.size() * sizeof(uint32_t));
+    content.append((const char *)entries.data(), entries.size() * sizeof(ArchiveEntry));
+    content.append(blob);
+    return writeFileAtomic(filename, content);
+}
+
+// Everything but the source itself which changes the transformed code of a file, the server only serves the clients with the same options
+static std::string optionsKey(const TransformerContext &ctx) {
+    uint64_t key = hashString(LJ_PRO_VERSION);
+    for (const auto &define : ctx.defines) {
+        key = hashString(define, key);
+    }
+    return toHex(hashString(ctx.compact ? "compact" : "", key));
+}
+
+static bool writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
+            return false;
         }
+        data.remove_prefix(n);
     }
+    return true;
+}
 
-    // std::cout << "[Debug] get Include " << includeContent << std::endl;
+// Reads until `size` bytes have been read, or until EOF if `size` is SIZE_MAX
+static bool readAll(int fd, std::string &data, size_t size = SIZE_MAX) {
+    char buf[65536];
+    while (data.size() < size) {
+        ssize_t n = read(fd, buf, std::min(sizeof(buf), size - data.size()));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0 && size == SIZE_MAX;
+        }
+        data.append(buf, n);
+    }
+    return true;
 }
 
-void CustomLuaTransformer::parse(int idx) {
-    int _idx   = idx;
-    auto token = tokenVec.at(_idx);
-    while (true) {
-        // fmt::println("parse {:8} {:8}", token.data, toString(token.kind));
+static int connectServer(const std::string &socketPath) {
+    sockaddr_un addr{};
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        switch (token.kind) {
-        case TokenKind::Foreach:
-            parseForeach(_idx);
-            break;
-        case TokenKind::Map:
-            parseMap(_idx);
-            break;
-        case TokenKind::Filter:
-            parseFilter(_idx);
-            break;
-        case TokenKind::CompTime:
-            parseCompTime(_idx);
-            break;
-        case TokenKind::Include:
-            parseInclude(_idx);
-            break;
-        default:
+// Asks the transform server for the output of a file. Returns false if there is no server or it can not serve the file, e.g. the server runs
+// with other options, or one of the env_vars read by the `$comp_time` blocks has another value in this process.
+//
+//   request:  "luajit-pro <options key>\n<cwd>\n<absolute path>\n<source hash>\n"
+//   response: "ok <output size>\n" { "env <hash> <name>\n" } "\n" <output>, or "miss\n"
+bool serverTransform(TransformerContext &ctx, const std::string &filename, std::string_view source, std::string &output) {
+    int fd = connectServer(ctx.serverSocket);
+    if (fd < 0) {
+        return false;
+    }
+    timeval timeout{10, 0}; // A server which hangs must not hang the loads
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::error_code ec;
+    std::string request = "luajit-pro " + optionsKey(ctx) + "\n" + std::filesystem::current_path(ec).string() + "\n" + absolutePath(filename) + "\n" + toHex(hashString(source)) + "\n";
+    std::string header;
+    bool ok = writeAll(fd, request);
+    // The header is small, it is read byte by byte up to the empty line so that the output can be read at once
+    for (char c; ok && read(fd, &c, 1) == 1;) {
+        header += c;
+        if (header == "miss\n" || (header.size() >= 2 && header.compare(header.size() - 2, 2, "\n\n") == 0)) {
             break;
         }
+    }
 
-        _idx++;
-        token = tokenVec.at(_idx);
-        if (token.kind == TokenKind::EndOfFile)
-            return;
+    size_t size = 0;
+    ok          = ok && sscanf(header.c_str(), "ok %zu\n", &size) == 1;
+    std::istringstream lines(header);
+    std::string line;
+    std::getline(lines, line);
+    while (ok && std::getline(lines, line) && !line.empty()) {
+        auto space = line.find(' ', 4);
+        ok         = line.compare(0, 4, "env ") == 0 && space != std::string::npos && hashEnv(line.substr(space + 1)) == line.substr(4, space - 4);
     }
+    output.clear();
+    ok = ok && readAll(fd, output, size);
+    close(fd);
+    return ok;
 }
 
-void CustomLuaTransformer::dumpContentLines(bool hasLineNumbers) {
-    std::cout << "\n\n";
-    if (hasLineNumbers) {
-        for (size_t i = 0; i < oldContentLines.size(); ++i) {
-            std::cout << i + 1 << ": " << oldContentLines[i] << std::endl;
+#ifdef __linux__
+// A long-running server which keeps the transformed output of the files it has been asked for, so a (re)load only costs a round trip on the
+// Unix socket. The files and everything they include are watched with inotify, and a file is transformed again as soon as it or one of its
+// dependencies changes. The transforms run in forked workers, so a broken file never takes the server down: it is served as a miss and
+// the client transforms it by itself(and reports the error). The server never waits for a worker, it reads their output in its poll loop
+// along with the requests and the events, and a file is served as a miss while it is being transformed. At most LJP_THREADS workers run at
+// once, the other dirty files wait for their turn. The requests are read and the replies written without blocking in the same loop, so a
+// slow client only holds up itself, and it is dropped after 10s.
+class TransformServer {
+  public:
+    TransformServer(TransformerContext &ctx, int listenFd) : ctx_(ctx), listenFd_(listenFd), optionsKey_(optionsKey(ctx)), inotifyFd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+
+    void run() {
+        while (true) {
+            std::vector<pollfd> fds = {{listenFd_, POLLIN, 0}, {inotifyFd_, POLLIN, 0}};
+            for (const auto &[fd, build] : builds_) {
+                fds.push_back({fd, POLLIN, 0});
+            }
+            size_t firstClient = fds.size();
+            for (const auto &[fd, client] : clients_) {
+                fds.push_back({fd, (short)(client.reply.empty() ? POLLIN : POLLOUT), 0});
+            }
+            if (poll(fds.data(), fds.size(), clients_.empty() ? -1 : 1000) < 0) {
+                continue;
+            }
+            for (size_t i = 2; i < firstClient; i++) {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    readBuild(fds[i].fd);
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                // Let a burst of events(e.g. an editor saving a file) settle before transforming
+                usleep(10000);
+                processEvents();
+                rebuildDirty();
+            }
+            for (size_t i = firstClient; i < fds.size(); i++) {
+                if (fds[i].revents != 0) {
+                    serveClient(fds[i].fd);
+                }
+            }
+            dropStalledClients();
+            if (fds[0].revents & POLLIN) {
+                int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd >= 0) {
+                    clients_[fd] = {{}, {}, 0, std::chrono::steady_clock::now()};
+                }
+            }
         }
-    } else {
-        for (size_t i = 0; i < oldContentLines.size(); ++i) {
-            std::cout << oldContentLines[i] << std::endl;
+    }
+
+  private:
+    struct Entry {
+        std::string cwd;
+        std::string path;
+        std::string sourceHash; // Hash of the source read by the last transform
+        bool valid    = false;  // False if the last transform has failed
+        bool building = false;  // A worker is transforming the file
+        TransformResult result;
+    };
+
+    // A worker transforming an entry, by the read end of its pipe
+    struct Build {
+        std::string key;
+        pid_t pid;
+        std::string message;
+    };
+
+    // A connection whose request is being read, or whose reply is being written once the request is complete
+    struct Client {
+        std::string request;
+        std::string reply;
+        size_t sent;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    TransformerContext &ctx_;
+    int listenFd_;
+    std::string optionsKey_;
+    int inotifyFd_;
+    std::unordered_map<std::string, Entry> entries_;                          // By "<cwd>\n<path>"
+    std::unordered_map<std::string, std::unordered_set<std::string>> users_; // Absolute path of a source or a dependency -> entries
+    std::unordered_map<int, std::string> watches_;                            // Watch descriptor -> absolute path
+    std::unordered_map<std::string, int> watchedFiles_;
+    std::unordered_set<std::string> dirty_;
+    std::unordered_map<int, Build> builds_;
+    std::unordered_map<int, Client> clients_;
+
+    // Reads what the client has sent so far, and writes as much of the reply as the socket takes once the request is complete
+    void serveClient(int fd) {
+        auto &client = clients_.at(fd);
+        if (client.reply.empty()) {
+            char buf[4096];
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return;
+            }
+            if (n <= 0) {
+                close(fd);
+                clients_.erase(fd);
+                return;
+            }
+            client.request.append(buf, n);
+            if (std::count(client.request.begin(), client.request.end(), '\n') < 4 && client.request.size() < 65536) {
+                return;
+            }
+            client.reply = serve(client.request);
+        }
+        ssize_t n = send(fd, client.reply.data() + client.sent, client.reply.size() - client.sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0 || (client.sent += n) == client.reply.size()) {
+            close(fd);
+            clients_.erase(fd);
         }
     }
-    std::cout << "\n\n";
-}
 
-} // namespace lua_transformer
+    // A client which has neither sent its request nor taken its reply within the timeout of serverTransform() is gone
+    void dropStalledClients() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = clients_.begin(); it != clients_.end();) {
+            if (now - it->second.start > std::chrono::seconds(10)) {
+                close(it->first);
+                it = clients_.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
 
-// Interface functions for lj_load.c
-extern "C" {
+    std::string serve(const std::string &request) {
+        std::istringstream lines(request);
+        std::string options, cwd, path, sourceHash;
+        std::getline(lines, options);
+        std::getline(lines, cwd);
+        std::getline(lines, path);
+        std::getline(lines, sourceHash);
+        if (options != "luajit-pro " + optionsKey_ || cwd.empty() || path.empty()) {
+            return "miss\n";
+        }
 
-using namespace lua_transformer;
+        // The events of a change made just before the request are already queued. The client does not wait for the transform, it is
+        // served by a later request.
+        processEvents();
+        auto key    = cwd + "\n" + path;
+        auto &entry = entries_[key];
+        if (entry.path.empty()) {
+            entry.cwd  = cwd;
+            entry.path = path;
+        }
+        if (!entry.building && (dirty_.count(key) || entry.sourceHash != sourceHash)) {
+            dirty_.insert(key);
+            rebuildDirty();
+        }
 
-const char *file_transform(const char *filename, LuaDoStringPtr func) {
-    static std::string proccessedSuffix  = ".1.proccessed";
-    static std::string transformedSuffix = ".2.transformed";
-    static std::string cacheDir          = LJ_PRO_CACHE_DIR;
-    static bool isInit                   = false;
-    if (!isInit) {
-        isInit = true;
+        // A dirty file which waits for a free worker is not served either
+        if (entry.building || dirty_.count(key) || !entry.valid || entry.sourceHash != sourceHash || !entry.result.cacheable) {
+            return "miss\n";
+        }
+        std::string reply = "ok " + std::to_string(entry.result.output.size()) + "\n";
+        for (const auto &name : entry.result.envDeps) {
+            reply += "env " + hashEnv(name) + " " + name + "\n";
+        }
+        return reply + "\n" + entry.result.output;
+    }
 
-        luaDoString = func;
+    static std::string depPath(const Entry &entry, const std::string &dep) {
+        return std::filesystem::path(dep).is_absolute() ? dep : absolutePath(entry.cwd + "/" + dep);
+    }
 
-        if (!std::filesystem::exists(cacheDir)) {
-            if (!std::filesystem::create_directory(cacheDir)) {
-                ASSERT(false, "Failed to create folder.");
+    // Starts the transform of the file in a forked worker, which sends the result back through a pipe(see readBuild()). The hash of the source
+    // it has read comes first, so it is known even if the transform fails, and the hashes of the dependencies are taken after the transform:
+    // "<source hash>\n<cacheable> <output size>\n" { "dep <hash> <path>\n" | "env <name>\n" } "\n" <output>
+    // The source and the dependencies of the last transform are watched before the worker starts, so a change made while it runs is not missed.
+    void build(const std::string &key, Entry &entry) {
+        entry.valid = false;
+        watch(entry.path, key);
+        for (const auto &dep : entry.result.deps) {
+            watch(depPath(entry, dep), key);
+        }
+        int pipeFds[2];
+        if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+            return;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipeFds[0]);
+            // The threads of the parallel transform are shared with the other workers
+            ctx_.threads = std::max<size_t>(1, ctx_.threads / (builds_.size() + 1));
+            MappedFile file(entry.path);
+            if (chdir(entry.cwd.c_str()) != 0 || !file.isOpen()) {
+                _exit(EXIT_FAILURE);
+            }
+            auto writeOut = [&](std::string_view data) {
+                while (!data.empty()) {
+                    ssize_t n = write(pipeFds[1], data.data(), data.size());
+                    if (n <= 0) {
+                        _exit(EXIT_FAILURE);
+                    }
+                    data.remove_prefix(n);
+                }
+            };
+            writeOut(toHex(hashString(file.view())) + "\n");
+            auto result         = transformSource(ctx_, entry.path, file.view());
+            std::string message = std::to_string(result.cacheable) + " " + std::to_string(result.output.size()) + "\n";
+            for (const auto &dep : result.deps) {
+                message += "dep " + hashFile(dep) + " " + dep + "\n";
+            }
+            for (const auto &name : result.envDeps) {
+                message += "env " + name + "\n";
             }
+            writeOut(message + "\n");
+            writeOut(result.output);
+            _exit(EXIT_SUCCESS);
+        }
+        close(pipeFds[1]);
+        if (pid < 0) {
+            close(pipeFds[0]);
+            return;
         }
+        entry.building      = true;
+        builds_[pipeFds[0]] = {key, pid, {}};
+    }
 
-        {
-            const char *value = std::getenv("LJP_KEEP_FILE");
-            if (value != nullptr && strcmp(value, "1") == 0) {
-                std::cout << "[luajit-pro] LJP_KEEP_FILE is enabled" << std::endl;
-            } else {
-                std::atexit([]() {
-                    for (const auto &file : removeFiles) {
-                        // std::cout << "[Debug][file_transform] remove => " << file << std::endl;
-                        std::remove(file.c_str());
-                    }
-                });
+    // Reads what the worker has written so far, and takes the result once it is done
+    void readBuild(int fd) {
+        auto &build = builds_.at(fd);
+        char buf[65536];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            build.message.append(buf, n);
+            return;
+        }
+        if (n < 0 && errno == EINTR) {
+            return;
+        }
+        close(fd);
+        int status = EXIT_FAILURE;
+        while (waitpid(build.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        bool ok             = n == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        std::string key     = std::move(build.key);
+        std::string message = std::move(build.message);
+        builds_.erase(fd);
+
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            it->second.building = false;
+            finishBuild(key, it->second, ok, message);
+        }
+        // The next dirty files, including this one if it has been changed again in the meantime
+        rebuildDirty();
+    }
+
+    void finishBuild(const std::string &key, Entry &entry, bool ok, const std::string &message) {
+        // The hash of the source the worker has read is taken even if the transform has failed, the file is transformed again once it changes
+        auto sourceEnd = message.find('\n');
+        if (sourceEnd != std::string::npos) {
+            entry.sourceHash = message.substr(0, sourceEnd);
+        }
+
+        auto headerEnd = message.find("\n\n");
+        int cacheable  = 0;
+        size_t size    = 0;
+        if (!ok || sourceEnd == std::string::npos || headerEnd == std::string::npos || sscanf(message.c_str() + sourceEnd + 1, "%d %zu", &cacheable, &size) != 2 || message.size() - headerEnd - 2 != size) {
+            std::cerr << "[luajit-pro-server] Failed to transform " << entry.path << std::endl;
+            return;
+        }
+        entry.result = TransformResult();
+        std::istringstream lines(message.substr(sourceEnd + 1, headerEnd - sourceEnd - 1));
+        std::string line;
+        std::getline(lines, line);
+        while (std::getline(lines, line)) {
+            auto space = line.find(' ', 4);
+            if (line.compare(0, 4, "dep ") == 0 && space != std::string::npos) {
+                auto dep  = line.substr(space + 1);
+                auto path = depPath(entry, dep);
+                entry.result.deps.push_back(dep);
+                // A dependency which was not watched while the worker ran(e.g. a new `$include`) may have been changed since it has been read
+                bool watched = watchedFiles_.count(path) != 0 && users_[path].count(key) != 0;
+                watch(path, key);
+                if (!watched && hashFile(path) != line.substr(4, space - 4)) {
+                    dirty_.insert(key);
+                }
+            } else if (line.compare(0, 4, "env ") == 0) {
+                entry.result.envDeps.push_back(line.substr(4));
             }
         }
+        entry.result.output    = message.substr(headerEnd + 2);
+        entry.result.cacheable = cacheable != 0;
+        entry.valid            = true;
+        std::cout << "[luajit-pro-server] Transformed " << entry.path << std::endl;
+    }
 
-        {
-            const char *value = std::getenv("LJP_WITH_PID_SUFFIX");
-            if (value != nullptr && strcmp(value, "1") == 0) {
-                std::cout << "[luajit-pro] LJP_WITH_PID_SUFFIX is enabled" << std::endl;
-                proccessedSuffix  = proccessedSuffix + "." + std::to_string((int)getpid());
-                transformedSuffix = transformedSuffix + "." + std::to_string((int)getpid());
+    void watch(const std::string &path, const std::string &key) {
+        users_[path].insert(key);
+        if (watchedFiles_.count(path) == 0) {
+            int wd = inotify_add_watch(inotifyFd_, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            if (wd >= 0) {
+                watches_[wd]        = path;
+                watchedFiles_[path] = wd;
             }
         }
     }
 
-    std::ifstream inputFile(filename);
-    if (!inputFile) {
-        assert(false && "Cannot open file!");
+    void processEvents() {
+        alignas(inotify_event) char buf[65536];
+        ssize_t n;
+        while ((n = read(inotifyFd_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n; p += sizeof(inotify_event) + ((inotify_event *)p)->len) {
+                auto event = (inotify_event *)p;
+                auto it    = watches_.find(event->wd);
+                if (it == watches_.end()) {
+                    continue;
+                }
+                for (const auto &key : users_[it->second]) {
+                    dirty_.insert(key);
+                }
+                if (event->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    // The file has been replaced(e.g. saved by rename), it is watched again by the next transform
+                    inotify_rm_watch(inotifyFd_, event->wd);
+                    watchedFiles_.erase(it->second);
+                    watches_.erase(it);
+                }
+            }
+        }
     }
 
-    // std::cout << "[Debug] inputFile => " << filename << std::endl;
+    // Starts the transform of the dirty files, up to LJP_THREADS workers. A file which is being transformed stays dirty, it is transformed
+    // again when its worker is done.
+    void rebuildDirty() {
+        for (auto key = dirty_.begin(); key != dirty_.end() && builds_.size() < ctx_.threads;) {
+            auto it = entries_.find(*key);
+            if (it != entries_.end() && it->second.building) {
+                key++;
+                continue;
+            }
+            if (it != entries_.end() && std::filesystem::exists(it->second.path)) {
+                build(*key, it->second);
+            } else if (it != entries_.end()) {
+                entries_.erase(it);
+            }
+            key = dirty_.erase(key);
+        }
+    }
+};
+#endif // __linux__
+
+} // namespace lua_transformer
 
-    bool disablePreprocess = false;
-    std::string firstLine;
-    if (std::getline(inputFile, firstLine)) {
-        // std::cout << "[Debug] first line => " << firstLine << std::endl;
-        std::regex pattern(R"(preprocess:\s*(\w+))"); // You can DISABLE preprocess by adding "preprocess: false" at the first line of the file after the "--[[luajit-pro]]" comment. e.g. "--[[luajit-pro]] preprocess: false"
-        std::smatch matches;
+// Interface functions for lj_load.c
+extern "C" {
 
-        if (std::regex_search(firstLine, matches, pattern)) {
-            disablePreprocess = matches[1] == "false";
-        }
+using namespace lua_transformer;
+
+// Each thread gets its own context on its first luajit-pro load
+static TransformerContext &currentContext(LuaDoStringPtr func) {
+    thread_local TransformerContext context(func);
+    return context;
+}
+
+// The returned chunk is allocated by malloc() and must be freed by the caller
+static char *toChunk(const std::string &output, size_t *outputSize) {
+    char *chunk = (char *)malloc(output.size());
+    if (chunk) {
+        std::copy(output.begin(), output.end(), chunk);
+    }
+    *outputSize = output.size();
+    return chunk;
+}
 
-        if (firstLine.find("--[[luajit-pro]]") == std::string::npos) {
-            // std::cout << "[luajit-pro] File: "<< filename << " does not contain the required comment: \"--[[luajit-pro]]\" at the first line." << std::endl;
-            return filename;
+// Transform the content of a luajit-pro file which has already been read by the caller. The returned chunk is allocated by malloc() and must be freed by the caller.
+char *file_transform(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize) {
+    auto &ctx = currentContext(func);
+    if (!ctx.serverSocket.empty()) {
+        std::string output;
+        TraceSpan span("server", filename, sourceSize);
+        if (serverTransform(ctx, filename, std::string_view(source, sourceSize), output)) {
+            span.bytes = output.size();
+            return toChunk(output, outputSize);
         }
-    } else {
-        assert(false && "Cannot read file!");
     }
-    inputFile.close();
+    auto result = transformSource(ctx, filename, std::string_view(source, sourceSize));
+    return toChunk(result.output, outputSize);
+}
 
-    std::filesystem::path filepath(filename);
-    std::string newFileName = cacheDir + "/" + filepath.filename().string();
+// Transform a luajit-pro buffer loaded by load()/loadstring()/luaL_loadbufferx(). `name` is the chunk name, e.g. "@file.lua", "=stdin" or the source itself for loadstring().
+// The returned chunk is allocated by malloc() and must be freed by the caller.
+char *string_transform(const char *name, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize) {
+    std::string label = (name[0] == '@' || name[0] == '=') ? std::string(name + 1) : std::string("[string]");
+    auto result       = transformBuffer(currentContext(func), label, std::string_view(source, sourceSize));
+    return toChunk(result.output, outputSize);
+}
 
-    std::string proccesedFile = newFileName + proccessedSuffix;
-    std::string cppCMD        = "";
-    if (disablePreprocess) {
-        std::cout << "[luajit-pro] preprocess is disabled in file: " << filename << std::endl;
-        cppCMD = std::string("cp ") + filename + " " + proccesedFile;
-    } else {
-        cppCMD = std::string("cpp ") + filename + " -E | sed '/^#/d' > " + proccesedFile; // `-E`: Preprocess only
+// Start the streaming transform of a large luajit-pro file, see TransformStream. Returns NULL if the file is not streamed, it is transformed
+// by file_transform() instead. `source` must outlive the stream.
+void *stream_transform_open(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func) {
+    return TransformStream::open(currentContext(func), filename, std::string_view(source, sourceSize)).release();
+}
+
+// Returns the next piece of the transformed code, which is valid until the next call, or NULL at the end
+const char *stream_transform_next(void *stream, size_t *size) {
+    auto piece = ((TransformStream *)stream)->next();
+    *size      = piece.size();
+    return piece.empty() ? nullptr : piece.data();
+}
+
+// The cache entry is only written if the stream has been read to the end
+void stream_transform_close(void *stream) { delete (TransformStream *)stream; }
+
+// Maps the luajit-pro file opened by the loader, so the source is not copied into a buffer. Returns NULL if it can not be mapped(e.g. a
+// pipe), it is then read by the loader. The mapping is released by source_unmap(*handle).
+const char *source_map(int fd, size_t *size, void **handle) {
+    auto file = std::make_unique<MappedFile>(fd);
+    if (!file->isOpen() || file->view().empty()) {
+        return nullptr;
     }
-    std::system(cppCMD.c_str());
-    removeFiles.push_back(proccesedFile);
+    // The source is read front to back, by the preprocessor or window by window by a stream
+    madvise((void *)file->view().data(), file->view().size(), MADV_SEQUENTIAL);
+    *size   = file->view().size();
+    *handle = file.get();
+    return file.release()->view().data();
+}
+
+void source_unmap(void *handle) { delete (MappedFile *)handle; }
 
-    // std::ifstream file(proccesedFile);
-    // std::string line;
-    // while (std::getline(file, line)) {
-    //     std::cout << "[Debug] get => " << line << std::endl;
-    // }
-    // file.close();
+// Tracing hooks for the phases in lj_load.c, see Tracer. `start` is a trace_clock() timestamp.
+int trace_enabled(void) { return Tracer::instance().enabled(); }
 
-    CustomLuaTransformer transformer(proccesedFile);
-    transformer.tokenize();
-    transformer.parse(0);
-    // transformer.dumpContentLines(false);
+uint64_t trace_clock(void) { return Tracer::now(); }
 
-    auto finalFilePath = newFileName + transformedSuffix;
-    removeFiles.push_back(finalFilePath);
+void trace_span(const char *name, const char *file, size_t bytes, uint64_t start) { Tracer::instance().span(name, file, bytes, start); }
 
-    std::ofstream outFile(finalFilePath, std::ios::trunc);
-    if (!outFile.is_open()) {
-        assert(false && "Cannot write file!");
+void trace_set_sink(TraceSinkPtr sink) { Tracer::instance().setSink(sink); }
+
+// Whether luaL_loadfilex() should try the bytecode cache. The bytecode cache is built on top of the transform cache, so LJP_NO_CACHE disables it as well.
+int bytecode_cache_enabled(LuaDoStringPtr func) {
+    auto &ctx = currentContext(func);
+    return ctx.bytecodeCacheEnabled && ctx.cacheEnabled;
+}
+
+// Returns the cached bytecode of a luajit-pro file, or NULL if there is no valid entry. The returned chunk is allocated by malloc() and must be freed by the caller.
+char *bytecode_cache_load(const char *filename, const char *source, size_t sourceSize, const char *vmTag, LuaDoStringPtr func, size_t *outputSize) {
+    std::string bytecodeFile;
+    std::string bytecode;
+    if (!bytecodeCacheFile(currentContext(func), filename, std::string_view(source, sourceSize), vmTag, bytecodeFile) || !readFile(bytecodeFile, bytecode) || bytecode.empty()) {
+        return nullptr;
     }
+    return toChunk(bytecode, outputSize);
+}
 
-    for (const auto &line : transformer.oldContentLines) {
-        outFile << line << std::endl;
+// Store the bytecode dumped from the prototype of a freshly transformed file. Nothing is stored if the transformed output was not cached, e.g. for `$comp_time`.
+void bytecode_cache_store(const char *filename, const char *source, size_t sourceSize, const char *vmTag, LuaDoStringPtr func, const char *bytecode, size_t bytecodeSize) {
+    std::string bytecodeFile;
+    if (bytecodeCacheFile(currentContext(func), filename, std::string_view(source, sourceSize), vmTag, bytecodeFile)) {
+        writeFileAtomic(bytecodeFile, std::string(bytecode, bytecodeSize));
     }
-    outFile.close();
+}
+
+// Whether the package searcher of the module archives should be installed, see LJP_ARCHIVE
+int archive_enabled(void) { return !moduleArchives().empty(); }
 
-    char *c_filepath = (char *)malloc(finalFilePath.size() + 1);
-    if (c_filepath) {
-        std::copy(finalFilePath.begin(), finalFilePath.end(), c_filepath);
-        c_filepath[finalFilePath.size()] = '\0'; // Null-terminate
+// Returns the code or bytecode of a module from the first archive containing it, or NULL. The data is mapped for the whole life of the process.
+const char *archive_find(const char *name, size_t *size, const char **chunkname) {
+    for (const auto &archive : moduleArchives()) {
+        std::string_view code;
+        if (archive->find(name, *chunkname, code) != nullptr) {
+            *size = code.size();
+            return code.data();
+        }
     }
+    return nullptr;
+}
 
-    return c_filepath;
+// Run the transform server of luajit-pro-server on `socketPath` until the process is killed. Returns 0 if the server can not be started.
+int transform_server(const char *socketPath, LuaDoStringPtr func) {
+#ifdef __linux__
+    // The stale socket of a previous server is replaced, a running server is left alone
+    int running = connectServer(socketPath);
+    if (running >= 0) {
+        close(running);
+        std::cerr << "[luajit-pro-server] A server is already running on " << socketPath << std::endl;
+        return 0;
+    }
+    sockaddr_un addr{};
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || strlen(socketPath) >= sizeof(addr.sun_path)) {
+        std::cerr << "[luajit-pro-server] Invalid socket path: " << socketPath << std::endl;
+        return 0;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    unlink(socketPath);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        std::cerr << "[luajit-pro-server] Cannot listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        return 0;
+    }
+    std::cout << "[luajit-pro-server] Listening on " << socketPath << std::endl;
+
+    // The server must not ask itself
+    auto &ctx = currentContext(func);
+    ctx.serverSocket.clear();
+    TransformServer(ctx, fd).run();
+    return 1;
+#else
+    (void)func;
+    std::cerr << "[luajit-pro-server] The transform server needs inotify(Linux): " << socketPath << std::endl;
+    return 0;
+#endif
 }
 
-void string_transform(const char *str, size_t *output_size) {
-    // TODO:
-    // std::string inputString(str);
-    // std::cout << "[Debug]transformedString => \n>>>\n" << inputString << "\n<<<" << std::endl;
-    // *output_size = inputString.size();
-    // str = (const char *)inputString.c_str();
+// Write a module archive, used by luajit-pro-aot. Returns 0 on failure.
+int archive_write(const char *filename, size_t count, const char *const *names, const char *const *chunknames, const char *const *data, const size_t *sizes) {
+    std::vector<std::string_view> nameVec, chunknameVec, dataVec;
+    for (size_t i = 0; i < count; i++) {
+        nameVec.push_back(names[i]);
+        chunknameVec.push_back(chunknames[i]);
+        dataVec.emplace_back(data[i], sizes[i]);
+    }
+    return writeArchive(filename, nameVec, chunknameVec, dataVec);
 }
 }
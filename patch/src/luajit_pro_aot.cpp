@@ -0,0 +1,383 @@
+// Ahead-of-time compiler for luajit-pro source trees.
+//
+// Every `.lua` file under the source directory is preprocessed and transformed exactly like the runtime loader does, and written to the same
+// relative path under the output directory, either as plain Lua code or as LuaJIT bytecode(`-b`). The files are processed on a work-stealing
+// thread pool. Rebuilds are incremental: the transform itself goes through the content-addressed transform cache(`.luajit_pro`), and an output
+// is only parsed/written again if the hash of its transformed code differs from the one recorded in `<out_dir>/.luajit-pro-aot`.
+//
+// With `-a <archive>`, all the outputs are also packed into a module archive, which is served to `require` by name through LJP_ARCHIVE, see
+// ModuleArchive in lj_load_helper.cpp.
+//
+// Usage: luajit-pro-aot [-j threads] [-b] [-f] [-a archive] <src_dir> <out_dir>
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+#include "luajit.h"
+}
+
+typedef const char *(*LuaDoStringPtr)(const char *, const char *);
+
+// Provided by lj_load.c and lj_load_helper.cpp
+extern "C" const char *do_lua_stiring(const char *code_name, const char *str);
+extern "C" const char *ljp_vm_tag(void);
+extern "C" char *file_transform(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize);
+extern "C" int archive_write(const char *filename, size_t count, const char *const *names, const char *const *chunknames, const char *const *data, const size_t *sizes);
+
+namespace fs = std::filesystem;
+
+// A fixed set of jobs is distributed round-robin over per-thread deques. A thread takes its own jobs from the back and steals from the front of
+// the other deques when it runs out of work, so a few large files never leave the other threads idle.
+class WorkStealingPool {
+  public:
+    WorkStealingPool(size_t numThreads, size_t numJobs) : queues_(numThreads) {
+        for (size_t job = 0; job < numJobs; job++) {
+            queues_[job % numThreads].jobs.push_back(job);
+        }
+    }
+
+    // `run(thread, job)` is called exactly once for every job
+    void run(const std::function<void(size_t, size_t)> &run) {
+        std::vector<std::thread> threads;
+        for (size_t thread = 0; thread < queues_.size(); thread++) {
+            threads.emplace_back([this, thread, &run] {
+                size_t job;
+                while (pop(thread, job) || steal(thread, job)) {
+                    run(thread, job);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+    std::vector<Queue> queues_;
+
+    bool pop(size_t thread, size_t &job) {
+        auto &queue = queues_[thread];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) {
+            return false;
+        }
+        job = queue.jobs.back();
+        queue.jobs.pop_back();
+        return true;
+    }
+
+    // No job is ever added after the start, so there is no work left once every queue is empty
+    bool steal(size_t thread, size_t &job) {
+        for (size_t i = 1; i < queues_.size(); i++) {
+            auto &queue = queues_[(thread + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs.empty()) {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// 64-bit FNV-1a, the same hash as the transform cache
+static uint64_t hashString(std::string_view str, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string toHex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return buf;
+}
+
+static bool readFile(const fs::path &filename, std::string &content) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+static bool writeFileAtomic(const fs::path &filename, std::string_view content) {
+    fs::path tmpFile = filename.string() + ".tmp";
+    {
+        std::ofstream outFile(tmpFile, std::ios::binary | std::ios::trunc);
+        if (!outFile.is_open() || !outFile.write(content.data(), content.size())) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmpFile, filename, ec);
+    return !ec;
+}
+
+struct ChunkReader {
+    const char *data;
+    size_t size;
+};
+
+static const char *readChunk(lua_State *L, void *ud, size_t *size) {
+    auto reader = (ChunkReader *)ud;
+    (void)L;
+    *size        = reader->size;
+    reader->size = 0;
+    return *size > 0 ? reader->data : nullptr;
+}
+
+static int writeBytecode(lua_State *L, const void *p, size_t size, void *ud) {
+    (void)L;
+    ((std::string *)ud)->append((const char *)p, size);
+    return 0;
+}
+
+enum class JobStatus {
+    UpToDate,
+    Built,
+    Failed,
+};
+
+struct Job {
+    std::string file; // Relative to the source directory
+    JobStatus status = JobStatus::Failed;
+    std::string stamp; // Hash of the transformed code and the output mode
+    std::string output; // Only kept for the archive
+};
+
+// "a/b.lua" is required as "a.b", and "a/init.lua" as "a" as well
+static std::vector<std::string> moduleNames(const std::string &file) {
+    std::string name = fs::path(file).replace_extension().generic_string();
+    std::replace(name.begin(), name.end(), '/', '.');
+    std::vector<std::string> names{name};
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".init") == 0) {
+        names.push_back(name.substr(0, name.size() - 5));
+    }
+    return names;
+}
+
+static void usage() {
+    std::cerr << "Usage: luajit-pro-aot [-j threads] [-b] [-f] [-a archive] <src_dir> <out_dir>\n"
+              << "  -j threads  Number of worker threads(default: all cores)\n"
+              << "  -b          Write LuaJIT bytecode instead of Lua code\n"
+              << "  -f          Rebuild every file, ignoring the previous build\n"
+              << "  -a archive  Also pack all the outputs into a module archive for LJP_ARCHIVE" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    bool bytecode     = false;
+    bool force        = false;
+    std::string archive;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            numThreads = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-b") == 0) {
+            bytecode = true;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            force = true;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            archive = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 2) {
+        usage();
+    }
+
+    fs::path srcDir = args[0];
+    fs::path outDir = args[1];
+    if (!fs::is_directory(srcDir)) {
+        std::cerr << "[luajit-pro-aot] Not a directory: " << srcDir << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The bytecode is only valid for the VM it was dumped by(the same tag as the bytecode cache of lj_load.c, which does not depend on the time
+    // of the build), the defines and everything else are already reflected by the transformed code
+    std::string mode = bytecode ? std::string("bc ") + ljp_vm_tag() : std::string("lua");
+
+    std::vector<Job> jobs;
+    auto absOutDir = fs::absolute(outDir).lexically_normal();
+    for (auto it = fs::recursive_directory_iterator(srcDir); it != fs::recursive_directory_iterator(); ++it) {
+        if (it->is_directory() && fs::absolute(it->path()).lexically_normal() == absOutDir) {
+            it.disable_recursion_pending(); // The output directory may be inside of the source directory
+        } else if (it->is_regular_file() && it->path().extension() == ".lua") {
+            jobs.emplace_back();
+            jobs.back().file = it->path().lexically_relative(srcDir).string();
+        }
+    }
+
+    // "<stamp> <file>" per line
+    fs::path indexFile = outDir / ".luajit-pro-aot";
+    std::unordered_map<std::string, std::string> index;
+    {
+        std::ifstream file(indexFile);
+        std::string line;
+        while (std::getline(file, line)) {
+            auto space = line.find(' ');
+            if (space != std::string::npos) {
+                index[line.substr(space + 1)] = line.substr(0, space);
+            }
+        }
+    }
+
+    numThreads = std::max<size_t>(1, std::min(numThreads, jobs.size()));
+    // The workers already keep the cores busy, so the segments of a large file(see transformParallel() in lj_load_helper.cpp) only get the
+    // cores left over by them, unless LJP_THREADS is set. The contexts of the workers are created after this.
+    if (std::getenv("LJP_THREADS") == nullptr) {
+        size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        setenv("LJP_THREADS", std::to_string(std::max<size_t>(1, cores / numThreads)).c_str(), 1);
+    }
+    std::vector<lua_State *> states(numThreads, nullptr); // One VM per worker thread for the bytecode emission
+    std::mutex logMutex;
+    auto start = std::chrono::steady_clock::now();
+
+    WorkStealingPool pool(numThreads, jobs.size());
+    pool.run([&](size_t thread, size_t jobIdx) {
+        auto &job   = jobs[jobIdx];
+        auto srcFile = srcDir / job.file;
+        auto outFile = outDir / job.file;
+        auto fail    = [&](const std::string &msg) {
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cerr << "[luajit-pro-aot] " << srcFile.string() << ": " << msg << std::endl;
+            job.status = JobStatus::Failed;
+        };
+
+        std::string source;
+        if (!readFile(srcFile, source)) {
+            return fail("cannot read file");
+        }
+
+        size_t chunkSize;
+        char *chunk = file_transform(srcFile.string().c_str(), source.data(), source.size(), do_lua_stiring, &chunkSize);
+        if (chunk == nullptr) {
+            return fail("out of memory");
+        }
+        std::string code(chunk, chunkSize);
+        free(chunk);
+
+        job.stamp = toHex(hashString(code, hashString(mode)));
+        auto previous = index.find(job.file);
+        if (!force && previous != index.end() && previous->second == job.stamp && fs::exists(outFile)) {
+            job.status = JobStatus::UpToDate;
+            return;
+        }
+
+        std::string output;
+        if (bytecode) {
+            auto &L = states[thread];
+            if (L == nullptr) {
+                L = luaL_newstate();
+            }
+            // The code has already been transformed, so it is loaded by lua_load() directly instead of luaL_loadbuffer()
+            ChunkReader reader{code.data(), code.size()};
+            std::string chunkname = "@" + job.file;
+            if (lua_load(L, readChunk, &reader, chunkname.c_str()) != 0) {
+                std::string msg = lua_tostring(L, -1);
+                lua_settop(L, 0);
+                return fail(msg);
+            }
+            lua_dump(L, writeBytecode, &output);
+            lua_settop(L, 0);
+        } else {
+            output = std::move(code);
+        }
+
+        std::error_code ec;
+        fs::create_directories(outFile.parent_path(), ec);
+        if (!writeFileAtomic(outFile, output)) {
+            return fail("cannot write " + outFile.string());
+        }
+        job.status = JobStatus::Built;
+        if (!archive.empty()) {
+            job.output = std::move(output);
+        }
+    });
+
+    for (auto L : states) {
+        if (L != nullptr) {
+            lua_close(L);
+        }
+    }
+
+    size_t built = 0, upToDate = 0, failed = 0;
+    std::string newIndex;
+    for (const auto &job : jobs) {
+        built += job.status == JobStatus::Built;
+        upToDate += job.status == JobStatus::UpToDate;
+        failed += job.status == JobStatus::Failed;
+        if (job.status != JobStatus::Failed) {
+            newIndex += job.stamp + " " + job.file + "\n";
+        }
+    }
+    std::error_code ec;
+    fs::create_directories(outDir, ec);
+    writeFileAtomic(indexFile, newIndex);
+
+    if (!archive.empty() && failed == 0) {
+        // The outputs which are up to date have not been read
+        std::vector<std::string> names, chunknames;
+        std::vector<const char *> nameVec, chunknameVec, dataVec;
+        std::vector<size_t> sizes;
+        for (auto &job : jobs) {
+            if (job.status == JobStatus::UpToDate && !readFile(outDir / job.file, job.output)) {
+                std::cerr << "[luajit-pro-aot] Cannot read " << (outDir / job.file).string() << std::endl;
+                return EXIT_FAILURE;
+            }
+            for (auto &name : moduleNames(job.file)) {
+                names.push_back(name);
+                chunknames.push_back("@" + job.file);
+                dataVec.push_back(job.output.data());
+                sizes.push_back(job.output.size());
+            }
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            nameVec.push_back(names[i].c_str());
+            chunknameVec.push_back(chunknames[i].c_str());
+        }
+        if (!archive_write(archive.c_str(), names.size(), nameVec.data(), chunknameVec.data(), dataVec.data(), sizes.data())) {
+            std::cerr << "[luajit-pro-aot] Cannot write the archive " << archive << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "[luajit-pro-aot] " << names.size() << " modules archived in " << archive << std::endl;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[luajit-pro-aot] " << built << " built, " << upToDate << " up to date, " << failed << " failed in " << elapsed << "ms with " << numThreads << " threads" << std::endl;
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+// Transform-time benchmark for luajit-pro.
+//
+// A synthetic luajit-pro source of the given number of lines is generated for every size, together with the files it `$include`s, and loaded
+// in two ways: the source is transformed by file_transform()(with the transform cache and the `$comp_time` cache disabled, so every run does
+// the whole work), and the transformed code, i.e. the equivalent plain Lua code, is parsed by lua_load() as a baseline. The per-phase times are
+// collected through the trace sink of the transformer, see Tracer in lj_load_helper.cpp. The best of `-n` runs is reported for every size,
+// followed by the scaling exponent of the transform time between two consecutive sizes(1.0 is linear). With `-t`, the transform is also measured
+// with 1, 2, 4, ... threads(see transformParallel() in lj_load_helper.cpp) to show how it scales with the number of threads.
+//
+// Usage: luajit-pro-bench [-n runs] [-d density] [-D depth] [-c comp_time] [-i includes] [-w dir] [-m max_exponent] [-t threads] [lines...]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+#include "luajit.h"
+}
+
+typedef const char *(*LuaDoStringPtr)(const char *, const char *);
+typedef void (*TraceSinkPtr)(const char *name, const char *file, size_t bytes, uint64_t start, uint64_t end);
+
+// Provided by lj_load.c and lj_load_helper.cpp
+extern "C" const char *do_lua_stiring(const char *code_name, const char *str);
+extern "C" char *file_transform(const char *filename, const char *source, size_t sourceSize, LuaDoStringPtr func, size_t *outputSize);
+extern "C" void trace_set_sink(TraceSinkPtr sink);
+
+namespace fs = std::filesystem;
+
+struct CorpusOptions {
+    size_t lines    = 0;
+    double density  = 0.2; // Fraction of the statements which are operator sites
+    int depth       = 2;   // Number of blocks around the statements of every function
+    int compTime    = 4;   // Number of `$comp_time` blocks
+    int includes    = 4;   // Number of `$include`d files
+    size_t fnLength = 40;  // Statements per generated function, the locals of a Lua function are limited to 200
+};
+
+// Deterministic, so the corpus of a given size is the same on every run and every machine
+class Random {
+  public:
+    uint32_t next() {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+    double uniform() { return next() / 4294967296.0; }
+
+  private:
+    uint32_t state_ = 2463534242u;
+};
+
+// One statement of a generated function, `k` makes the names unique inside of the function
+static std::string statement(Random &random, const CorpusOptions &opts, size_t k, const std::string &indent) {
+    std::string r = "r" + std::to_string(k);
+    if (random.uniform() >= opts.density) {
+        switch (random.next() % 3) {
+        case 0:
+            return indent + "local " + r + " = tbl[" + std::to_string(k % 8 + 1) + "] * 2 + " + std::to_string(k) + "\n";
+        case 1:
+            return indent + "local " + r + " = { a = " + std::to_string(k) + ", b = { \"s" + std::to_string(k) + "\", " + std::to_string(k) + " } } -- comment\n";
+        default:
+            return indent + "local " + r + " = string.format(\"%d\", #tbl + " + std::to_string(k) + ")\n";
+        }
+    }
+    switch (random.next() % 8) {
+    case 0:
+        return indent + "local " + r + " = tbl.map{ x => return x * " + std::to_string(k) + " }\n";
+    case 1:
+        return indent + "local " + r + " = tbl.filter{ x =>\n" + indent + "    local limit = " + std::to_string(k) + "\n" + indent + "    return x < limit\n" + indent + "}\n";
+    case 2:
+        return indent + "tbl.foreach{ x => sum = sum + x }\n" + indent + "local " + r + " = sum\n";
+    case 3:
+        return indent + "local " + r + " = tbl.zipWithIndex.filter{ (i, x) => return i % 2 == 0 }\n";
+    case 4:
+        return indent + "local " + r + " = tbl.map{ x => return x + 1 }.filter{ y => return y % 3 == 0 }\n";
+    case 5:
+        return indent + "local " + r + " = tbl.any{ x => return x > " + std::to_string(k) + " }\n";
+    case 6:
+        return indent + "local " + r + " = tbl.take{2}\n";
+    default:
+        return indent + "local " + r + " = tbl.map{tostring}\n";
+    }
+}
+
+static std::string function(Random &random, const CorpusOptions &opts, const std::string &name) {
+    std::string code = name + " = function(tbl)\n    local sum = 0\n";
+    std::string indent = "    ";
+    for (int d = 0; d < opts.depth; d++) {
+        code += indent + (d % 2 == 0 ? "if tbl then\n" : "for _ = 1, 1 do\n");
+        indent += "    ";
+    }
+    for (size_t k = 0; k < opts.fnLength; k++) {
+        code += statement(random, opts, k, indent);
+    }
+    for (int d = 0; d < opts.depth; d++) {
+        indent.resize(indent.size() - 4);
+        code += indent + "end\n";
+    }
+    return code + "    return sum\nend\n";
+}
+
+// Writes the main file and its includes into `dir`, the includes are resolved by package.searchpath() relative to the current directory
+static fs::path generateCorpus(const fs::path &dir, const CorpusOptions &opts) {
+    Random random;
+    std::string name = "bench_" + std::to_string(opts.lines);
+    for (int i = 0; i < opts.includes; i++) {
+        std::string code = "--[[luajit-pro]]\n" + function(random, opts, "M.inc" + std::to_string(i));
+        std::ofstream(dir / (name + "_inc" + std::to_string(i) + ".lua")) << code;
+    }
+
+    std::string code  = "--[[luajit-pro]]\nlocal M = {}\n";
+    size_t lines      = 2;
+    size_t functions  = 0;
+    size_t estimated  = std::max<size_t>(1, opts.lines / (opts.fnLength + 2 * opts.depth + 4));
+    int compTimeLeft  = opts.compTime;
+    int includesLeft  = opts.includes;
+    while (lines < opts.lines) {
+        // Spread the `$comp_time` blocks and the includes over the whole file
+        if (compTimeLeft > 0 && functions >= estimated * (opts.compTime - compTimeLeft) / opts.compTime) {
+            int id = opts.compTime - compTimeLeft--;
+            code += "$comp_time {\n    local s = \"\"\n    for i = 1, 4 do\n        s = s .. string.format(\"M.ct" + std::to_string(id) + "_%d = %d\\n\", i, i)\n    end\n    return s\n}\n";
+        }
+        if (includesLeft > 0 && functions >= estimated * (opts.includes - includesLeft) / opts.includes) {
+            code += "$include(\"" + name + "_inc" + std::to_string(opts.includes - includesLeft--) + "\")\n";
+        }
+        std::string fn = function(random, opts, "M.f" + std::to_string(functions++));
+        lines += std::count(fn.begin(), fn.end(), '\n');
+        code += fn;
+    }
+    code += "return M\n";
+
+    fs::path file = dir / (name + ".lua");
+    std::ofstream(file) << code;
+    return file;
+}
+
+// Total time and bytes of every phase reported through the trace sink
+struct PhaseTimes {
+    std::map<std::string, uint64_t> us;
+    std::map<std::string, size_t> bytes;
+};
+
+static PhaseTimes phaseTimes;
+static std::mutex phaseMutex;
+
+// Called on every thread of the transform, the phases of a parallel transform add up the time of all its threads
+static void collectSpan(const char *name, const char *file, size_t bytes, uint64_t start, uint64_t end) {
+    (void)file;
+    std::lock_guard<std::mutex> lock(phaseMutex);
+    // "comp_time <name>:<line>" and "include <package>" are summed up over all the blocks
+    std::string phase(name, strcspn(name, " "));
+    phaseTimes.us[phase] += end - start;
+    phaseTimes.bytes[phase] += bytes;
+}
+
+struct ChunkReader {
+    const char *data;
+    size_t size;
+};
+
+static const char *readChunk(lua_State *L, void *ud, size_t *size) {
+    auto reader = (ChunkReader *)ud;
+    (void)L;
+    *size        = reader->size;
+    reader->size = 0;
+    return *size > 0 ? reader->data : nullptr;
+}
+
+static uint64_t nowUs() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// Best transform time of `runs` runs with LJP_THREADS=threads. The options are read when the transformer context of a thread is created, so
+// the runs are done on a new thread, which gets its own context.
+static uint64_t transformWithThreads(const std::string &path, const std::string &source, int threads, int runs) {
+    setenv("LJP_THREADS", std::to_string(threads).c_str(), 1);
+    uint64_t best = UINT64_MAX;
+    std::thread([&]() {
+        for (int run = 0; run < runs; run++) {
+            size_t chunkSize;
+            uint64_t start = nowUs();
+            char *chunk    = file_transform(path.c_str(), source.data(), source.size(), do_lua_stiring, &chunkSize);
+            best           = std::min(best, nowUs() - start);
+            free(chunk);
+        }
+    }).join();
+    return best;
+}
+
+static double mbPerSec(size_t bytes, uint64_t us) { return us == 0 ? 0.0 : bytes / (double)us; }
+
+struct Sample {
+    size_t lines;
+    size_t sourceBytes;
+    size_t outputBytes;
+    uint64_t transformUs;
+    uint64_t loadUs;
+    PhaseTimes phases;
+    long peakRssKb;
+};
+
+static void usage() {
+    std::cerr << "Usage: luajit-pro-bench [-n runs] [-d density] [-D depth] [-c comp_time] [-i includes] [-w dir] [-m max_exponent] [-t threads] [lines...]\n"
+              << "  -n runs          Number of runs per size, the best one is reported(default: 3)\n"
+              << "  -d density       Fraction of the statements which are operator sites(default: 0.2)\n"
+              << "  -D depth         Number of nested blocks around the statements(default: 2)\n"
+              << "  -c comp_time     Number of $comp_time blocks per file(default: 4)\n"
+              << "  -i includes      Number of $include'd files per file(default: 4)\n"
+              << "  -w dir           Directory of the generated corpus(default: a new directory in the temp directory)\n"
+              << "  -m max_exponent  Fail if the transform time grows faster than lines^max_exponent between two sizes\n"
+              << "  -t threads       Also measure the transform with 1, 2, 4, ... up to `threads` threads\n"
+              << "  lines            Sizes of the generated files(default: 1000 10000 100000 1000000)" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    CorpusOptions opts;
+    int runs           = 3;
+    double maxExponent = 0.0;
+    int maxThreads     = 0;
+    fs::path workDir;
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "-n") == 0 && hasValue) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-d") == 0 && hasValue) {
+            opts.density = std::clamp(atof(argv[++i]), 0.0, 1.0);
+        } else if (strcmp(argv[i], "-D") == 0 && hasValue) {
+            opts.depth = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-c") == 0 && hasValue) {
+            opts.compTime = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-i") == 0 && hasValue) {
+            opts.includes = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-w") == 0 && hasValue) {
+            workDir = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && hasValue) {
+            maxExponent = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && hasValue) {
+            maxThreads = std::max(1, atoi(argv[++i]));
+        } else if (argv[i][0] == '-' || atol(argv[i]) <= 0) {
+            usage();
+        } else {
+            sizes.push_back(atol(argv[i]));
+        }
+    }
+    if (sizes.empty()) {
+        sizes = {1000, 10000, 100000, 1000000};
+    }
+    std::sort(sizes.begin(), sizes.end());
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    if (maxThreads > 0) {
+        threadCounts.push_back(maxThreads);
+    }
+
+    if (workDir.empty()) {
+        workDir = fs::temp_directory_path() / ("luajit-pro-bench." + std::to_string((int)getpid()));
+    }
+    std::error_code ec;
+    fs::create_directories(workDir, ec);
+    if (ec || chdir(workDir.c_str()) != 0) {
+        std::cerr << "[luajit-pro-bench] Cannot use the directory: " << workDir << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Measure the whole work on every run, the options are read by the transformer on its first use
+    setenv("LJP_NO_CACHE", "1", 1);
+    trace_set_sink(collectSpan);
+    lua_State *L = luaL_newstate();
+
+    std::cout << "[luajit-pro-bench] corpus: " << workDir.string() << ", density " << opts.density << ", depth " << opts.depth << ", " << opts.compTime << " comp_time, " << opts.includes << " includes, best of " << runs << " runs" << std::endl;
+    std::vector<Sample> samples;
+    for (size_t lines : sizes) {
+        opts.lines       = lines;
+        fs::path file    = generateCorpus(".", opts);
+        std::string path = file.lexically_normal().string();
+        std::string source;
+        {
+            std::ifstream in(file, std::ios::binary);
+            source.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+
+        Sample best{lines, source.size(), 0, UINT64_MAX, UINT64_MAX, {}, 0};
+        for (int run = 0; run < runs; run++) {
+            phaseTimes = PhaseTimes();
+
+            size_t chunkSize;
+            uint64_t start = nowUs();
+            char *chunk    = file_transform(path.c_str(), source.data(), source.size(), do_lua_stiring, &chunkSize);
+            uint64_t transformUs = nowUs() - start;
+            if (chunk == nullptr) {
+                std::cerr << "[luajit-pro-bench] Out of memory" << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            // The transformed code is plain Lua, so lua_load() only runs the LuaJIT parser on it
+            ChunkReader reader{chunk, chunkSize};
+            std::string chunkname = "@" + path;
+            start                 = nowUs();
+            int status            = lua_load(L, readChunk, &reader, chunkname.c_str());
+            uint64_t loadUs       = nowUs() - start;
+            free(chunk);
+            if (status != 0) {
+                std::cerr << "[luajit-pro-bench] " << lua_tostring(L, -1) << std::endl;
+                return EXIT_FAILURE;
+            }
+            lua_settop(L, 0);
+            lua_gc(L, LUA_GCCOLLECT, 0);
+
+            if (transformUs < best.transformUs) {
+                best.transformUs = transformUs;
+                best.outputBytes = chunkSize;
+                best.phases      = phaseTimes;
+            }
+            best.loadUs = std::min(best.loadUs, loadUs);
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        best.peakRssKb = usage.ru_maxrss;
+        samples.push_back(best);
+
+        printf("%8zu lines %10zu bytes: transform %9.2fms %7.2fMB/s, lua_load %9.2fms %7.2fMB/s, transform/lua_load %5.2fx, peak rss %ldKB\n", best.lines, best.sourceBytes, best.transformUs / 1000.0, mbPerSec(best.sourceBytes, best.transformUs), best.loadUs / 1000.0,
+               mbPerSec(best.outputBytes, best.loadUs), best.loadUs == 0 ? 0.0 : best.transformUs / (double)best.loadUs, best.peakRssKb);
+        // The `$comp_time` and include spans are nested in "parse", and the phases of the included files are counted in their own phases as well
+        for (const auto &[phase, us] : best.phases.us) {
+            printf("    %-12s %9.2fms %7.2fMB/s\n", phase.c_str(), us / 1000.0, mbPerSec(best.phases.bytes[phase], us));
+        }
+        // Only the inputs of LJP_PARALLEL_SIZE bytes or more are cut into segments, the smaller ones take the same time with any number of threads
+        uint64_t singleUs = 0;
+        for (int threads : threadCounts) {
+            uint64_t us = transformWithThreads(path, source, threads, runs);
+            singleUs    = threads == 1 ? us : singleUs;
+            printf("    threads %3d  transform %9.2fms %7.2fMB/s, speedup %5.2fx\n", threads, us / 1000.0, mbPerSec(best.sourceBytes, us), us == 0 ? 0.0 : singleUs / (double)us);
+        }
+        fflush(stdout);
+    }
+    lua_close(L);
+
+    bool superlinear = false;
+    for (size_t i = 1; i < samples.size(); i++) {
+        auto &a = samples[i - 1], &b = samples[i];
+        if (a.transformUs == 0 || b.lines == a.lines) {
+            continue;
+        }
+        double exponent = std::log(b.transformUs / (double)a.transformUs) / std::log(b.lines / (double)a.lines);
+        printf("scaling %zu -> %zu lines: transform ~ lines^%.2f\n", a.lines, b.lines, exponent);
+        if (maxExponent > 0.0 && exponent > maxExponent) {
+            superlinear = true;
+        }
+    }
+    if (superlinear) {
+        std::cerr << "[luajit-pro-bench] The transform time grows faster than lines^" << maxExponent << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
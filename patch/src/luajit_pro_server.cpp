@@ -0,0 +1,25 @@
+// Transform server for luajit-pro.
+//
+// Keeps the transformed code of every file it has been asked for, and watches the files and everything they include with inotify, so a
+// changed file is transformed again right away instead of on the next load. The runtime loader asks the server first when LJP_SERVER is set
+// to its socket, and falls back to transforming the file itself if the server is not running or can not serve the file. The server must run
+// with the same LJP_DEFINES/LJP_COMPACT as the clients, other clients are not served. See TransformServer in lj_load_helper.cpp.
+//
+// Usage: luajit-pro-server <socket>
+
+#include <cstdlib>
+#include <iostream>
+
+typedef const char *(*LuaDoStringPtr)(const char *, const char *);
+
+// Provided by lj_load.c and lj_load_helper.cpp
+extern "C" const char *do_lua_stiring(const char *code_name, const char *str);
+extern "C" int transform_server(const char *socketPath, LuaDoStringPtr func);
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: luajit-pro-server <socket>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return transform_server(argv[1], do_lua_stiring) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
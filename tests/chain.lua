@@ -0,0 +1,60 @@
+--[[luajit-pro]]
+-- Check that chained operators give the same result as the separate operators.
+-- Usage: ./run.sh chain.lua
+
+local function same(a, b)
+    assert(#a == #b, string.format("length %d ~= %d", #a, #b))
+    for i = 1, #a do
+        assert(a[i] == b[i], string.format("[%d] %s ~= %s", i, tostring(a[i]), tostring(b[i])))
+    end
+end
+
+local function isEven(x)
+    return x % 2 == 0
+end
+
+local function double(x)
+    return x * 2
+end
+
+local tbl = {}
+for i = 1, 100 do
+    tbl[i] = i
+end
+
+-- map -> filter
+local fused = tbl.map{ x => return x * 3 }.filter{ y => return y % 2 == 0 }
+local mapped = tbl.map{ x => return x * 3 }
+local expected = mapped.filter{ y => return y % 2 == 0 }
+same(fused, expected)
+
+-- map -> map -> filter, with simple operators and a multi-line body
+local fused2 = tbl.map{ x =>
+    local k = 3
+    return x + k
+}.map{double}.filter{isEven}
+local tmp1 = tbl.map{ x => return x + 3 }
+local tmp2 = tmp1.map{double}
+local expected2 = tmp2.filter{isEven}
+same(fused2, expected2)
+
+-- filter -> filter
+local fused3 = tbl.filter{ x => return x > 10 }.filter{ x => return x < 20 }
+same(fused3, {11, 12, 13, 14, 15, 16, 17, 18, 19})
+
+-- zipWithIndex on the first operator, the index is visible to the whole chain
+local sum = 0
+tbl.zipWithIndex.filter{ (i, x) => return i % 10 == 0 }.map{ y => return y + i }.foreach{ z =>
+    sum = sum + z
+}
+assert(sum == 1100, sum)
+
+-- filter -> foreach with a simple operator
+local count = 0
+local function inc()
+    count = count + 1
+end
+tbl.filter{isEven}.foreach{inc}
+assert(count == 50, count)
+
+print("chain: ok")
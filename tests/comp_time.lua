@@ -0,0 +1,25 @@
+--[[luajit-pro]]
+-- Check that the `$comp_time` blocks of all the loaded files share their globals, in load order. Run it twice with LJP_COMPTIME_CACHE=1
+-- as well: the blocks of this file and of comp_time_b.lua are then served from the cache, and they are replayed before the block of the
+-- chunk below, which is new on every run.
+-- Usage: ./run.sh comp_time.lua
+
+$comp_time(setup) {
+    SHARED_GREETING = "hello"
+    SHARED_COUNT    = 1
+    return "local greeting = \"" .. SHARED_GREETING .. "\""
+}
+assert(greeting == "hello")
+
+local b = assert(loadfile("comp_time_b.lua"))()
+assert(b == "hello from b", b)
+
+local code = string.format([==[--[[luajit-pro]]
+$comp_time(run) {
+    local run = %d
+    return "return \"" .. SHARED_GREETING .. "\", " .. SHARED_COUNT
+}]==], os.time())
+local greetingNow, count = assert(load(code, "=comp_time_run"))()
+assert(greetingNow == "hello" and count == 2, tostring(greetingNow) .. " " .. tostring(count))
+
+print("comp_time: ok")
@@ -0,0 +1,7 @@
+--[[luajit-pro]]
+-- Loaded by comp_time.lua, uses the globals of its `$comp_time` block
+
+$comp_time(use) {
+    SHARED_COUNT = SHARED_COUNT + 1
+    return "return \"" .. SHARED_GREETING .. " from b\""
+}
@@ -0,0 +1,53 @@
+--[[luajit-pro]] array: dense
+-- Check that the numeric loops of the dense array mode give the same results as ipairs.
+-- Usage: ./run.sh dense.lua
+
+local tbl = {}
+for i = 1, 100 do
+    tbl[i] = i
+end
+
+local doubled = tbl.map{ x => return x * 2 }
+assert(#doubled == 100 and doubled[100] == 200)
+
+local evens = tbl.zipWithIndex.filter{ (i, x) => return i % 2 == 0 }
+assert(#evens == 50 and evens[50] == 100)
+
+local sum = 0
+tbl.map{ x => return x + 1 }.filter{ y => return y % 2 == 0 }.foreach{ z =>
+    sum = sum + z
+}
+assert(sum == 2550, sum)
+
+local idx = tbl.find{ x => return x > 41 }
+assert(idx == 42, idx)
+
+-- Unlike ipairs, the numeric loop does not stop at a hole: the length is evaluated once before the loop
+local holes = {1, 2, 3}
+local count = 0
+holes.foreach{ x =>
+    count = count + 1
+    holes[2] = nil
+}
+assert(count == 3, count)
+
+-- Without the directive option, an annotation applies to the statement following it and is dropped if the statement has no site
+local counts = assert(load([==[--[[luajit-pro]]
+local holes, counts = {1, 2, 3}, {0, 0}
+--[[dense]]
+holes.foreach{ x =>
+    counts[1] = counts[1] + 1
+    holes[2] = nil
+}
+holes[2] = 2
+--[[dense]]
+local unrelated = 1
+holes.foreach{ x =>
+    counts[2] = counts[2] + 1
+    holes[2] = nil
+}
+return counts
+]==], "=dense"))()
+assert(counts[1] == 3 and counts[2] == 1, counts[1] .. " " .. counts[2])
+
+print("dense: ok")
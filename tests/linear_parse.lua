@@ -0,0 +1,55 @@
+-- Check that the transform time grows linearly with the file size.
+-- Generates luajit-pro files of 25k, 50k and 100k lines with nested operators and loads them.
+-- Usage: LJP_NO_CACHE=1 ./run.sh linear_parse.lua
+
+local unit = {
+    "do",
+    "    local t = {1, 2, 3}",
+    "    local sum = 0",
+    "    t.foreach{ x =>",
+    "        sum = sum + x",
+    "    }",
+    "    local m = t.map{ x => return x * 2 }",
+    "    local f = m.filter{ x => return x > 2 }",
+    "    t.zipWithIndex.foreach{ (i, x) =>",
+    "        local inner = f.map{ y => return y + i }",
+    "        total = total + #inner + sum",
+    "    }",
+    "end",
+}
+
+local function generate(path, lines)
+    local file = assert(io.open(path, "w"))
+    -- The nonce makes sure that the transform cache is never hit
+    file:write("--[[luajit-pro]]\n", "-- nonce: ", tostring(os.time()), " ", tostring(os.clock()), "\n")
+    local units = math.floor(lines / #unit)
+    local body = table.concat(unit, "\n") .. "\n"
+    for _ = 1, units do
+        file:write(body)
+    end
+    file:close()
+    return units
+end
+
+local sizes = {25000, 50000, 100000}
+local times = {}
+for _, lines in ipairs(sizes) do
+    local path = os.tmpname()
+    local units = generate(path, lines)
+
+    local start = os.clock()
+    local chunk = assert(loadfile(path))
+    times[lines] = os.clock() - start
+    os.remove(path)
+
+    total = 0
+    chunk()
+    assert(total == units * 24, string.format("unexpected result: %d", total))
+
+    print(string.format("%7d lines: %.3fs", lines, times[lines]))
+end
+
+-- Linear growth gives a ratio around 4, a quadratic parser gives around 16
+local ratio = times[100000] / times[25000]
+print(string.format("ratio(100k / 25k): %.2f", ratio))
+assert(ratio < 8, "transform time grows superlinearly")
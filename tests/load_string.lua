@@ -0,0 +1,29 @@
+-- Check that chunks loaded from memory get the luajit-pro syntax.
+-- Usage: ./run.sh load_string.lua
+
+local template = [==[--[[luajit-pro]]
+local tbl = ...
+local result = tbl.map{ x => return x * FACTOR }
+local sum = 0
+result.foreach{ x => sum = sum + x }
+return sum]==]
+
+for factor = 1, 3 do
+    local code = template:gsub("FACTOR", tostring(factor))
+    -- The same chunk is loaded many times, only the first load is transformed
+    for _ = 1, 1000 do
+        local chunk = assert(loadstring(code))
+        assert(chunk({1, 2, 3}) == 6 * factor)
+    end
+    assert(load(code)({1, 2, 3}) == 6 * factor)
+end
+
+-- The same text under another chunk name is transformed again, `__FILE__` and `#include` depend on the name
+local fileCode = "--[[luajit-pro]]\nreturn __FILE__"
+assert(load(fileCode, "@a.lua")() == "a.lua")
+assert(load(fileCode, "@b.lua")() == "b.lua")
+
+-- Chunks without the directive are loaded as is
+assert(loadstring("return 1 + 1")() == 2)
+
+print("load_string: ok")
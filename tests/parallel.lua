@@ -0,0 +1,62 @@
+-- Check that a large file which is cut into segments transformed by several threads(see LJP_THREADS) gives the expected results.
+-- Generates a luajit-pro data module of about 8MB with operator sites between and inside of its records, dense annotations, chains spanning
+-- multiple lines and `$comp_time` blocks all over it, loads it with loadfile() and checks the results and the line numbers against the plain
+-- Lua computation.
+-- Usage: LJP_THREADS=4 LJP_PARALLEL_SIZE=1 LJP_NO_CACHE=1 ./run.sh parallel.lua
+
+local parts = {
+    "--[[luajit-pro]]\n",
+    "#define SCALE 2\n",
+    "local vals = { 1, 2, 3, 4 }\n",
+    "local M = { sum = 0, data = {}, lines = {} }\n",
+    "M.data[1] = (function() return {\n",
+}
+local line = 5
+local function add(text)
+    parts[#parts + 1] = text
+    line = line + select(2, text:gsub("\n", ""))
+end
+
+local expectedSum = 0
+local expectedLines = {}
+for i = 1, 80000 do
+    if i % 1000 == 0 then
+        -- The records go into a function per 1000 of them, as a function has at most 65536 constants. Then a `$comp_time` block, which
+        -- gets a segment of its own, and sites at the top level with a dense annotation and a multi-line chain.
+        add("} end)()\n")
+        add(string.format("$comp_time(block%d) {\n    return \"M.ct%d = %d\"\n}\n", i, i, i))
+        add("do\n")
+        add("    --[[dense]]\n    local m = vals.map{ x => return x * SCALE }\n")
+        add(string.format("    local f = vals\n        .filter{ x => return x %% 2 == 0 }\n        .map{ x => return x + %d }\n", i))
+        add(string.format("    M.sum = M.sum + #m + m[4] + f[1]\n    M.lines[%d] = function() error(\"at\") end\nend\n", i))
+        expectedLines[i] = line - 1
+        add("M.data[#M.data + 1] = (function() return {\n")
+        expectedSum = expectedSum + 4 + 4 * 2 + 2 + i
+    else
+        -- The records of a table constructor, the input can be cut between them
+        add(string.format("    { id = %d, f = function(t) local r = t.map{ v => return v + %d } return r[1] end },\n", i, i))
+    end
+end
+add("} end)()\nreturn M\n")
+local code = table.concat(parts)
+
+local path = os.tmpname()
+local file = assert(io.open(path, "w"))
+file:write(code)
+file:close()
+local M = assert(loadfile(path))()
+os.remove(path)
+
+assert(M.sum == expectedSum, string.format("%d ~= %d", M.sum, expectedSum))
+for i, expected in pairs(expectedLines) do
+    assert(M["ct" .. i] == i)
+    local _, err = pcall(M.lines[i])
+    assert(err:find(":" .. expected .. ": at", 1, true), err .. " ~= line " .. expected)
+end
+for _, records in ipairs(M.data) do
+    for _, record in ipairs(records) do
+        assert(record.f({ 1 }) == record.id + 1)
+    end
+end
+
+print(string.format("parallel: ok(%.1fMB)", #code / 1e6))
@@ -0,0 +1,19 @@
+--[[luajit-pro]]
+-- Check that a file which only uses the preprocessor skips the transformer and still gets the directive line rewritten.
+-- Usage: ./run.sh prescan.lua
+
+#define SCALE 3
+#define NAME(X) "f" .. X
+
+local tbl = { 1, 2, 3 }
+local sum = 0
+for _, x in ipairs(tbl) do
+    sum = sum + x * SCALE
+end
+assert(sum == 18, sum)
+assert(NAME(1) == "f1" and string.format("%d", sum) == "18")
+
+-- `_tnew` comes from the rewritten directive line
+assert(type(_tnew) == "function")
+
+print("prescan: ok")
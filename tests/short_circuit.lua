@@ -0,0 +1,77 @@
+--[[luajit-pro]]
+-- Check the short-circuiting operators and that they stop at the first decisive element.
+-- Usage: ./run.sh short_circuit.lua
+
+local tbl = {}
+for i = 1, 1000 do
+    tbl[i] = i
+end
+
+local visited = 0
+local function over10(x)
+    visited = visited + 1
+    return x > 10
+end
+
+-- any/all
+local hasBig = tbl.any{over10}
+assert(hasBig == true and visited == 11, visited)
+local none = tbl.any{ x => return x > 1000 }
+assert(none == false)
+local allPositive = tbl.all{ x => return x > 0 }
+assert(allPositive == true)
+visited = 0
+local allSmall = tbl.all{ x =>
+    visited = visited + 1
+    return x < 5
+}
+assert(allSmall == false and visited == 5, visited)
+
+-- find returns the index, first returns the value
+local idx = tbl.find{ x => return x * x > 50 }
+assert(idx == 8, idx)
+local value = tbl.first{ x => return x % 7 == 0 }
+assert(value == 7, value)
+local missing = tbl.first{ x => return x < 0 }
+assert(missing == nil)
+local zipped = tbl.zipWithIndex.find{ (i, x) => return i > 3 and x % 5 == 0 }
+assert(zipped == 5, zipped)
+
+-- take/takeWhile
+local head = tbl.take{3}
+assert(#head == 3 and head[3] == 3)
+local n = 2000
+local all = tbl.take{n}
+assert(#all == 1000)
+local prefix = tbl.takeWhile{ x => return x <= 4 }
+assert(#prefix == 4 and prefix[4] == 4)
+
+-- As the last operator of a chain
+local evens = tbl.filter{ x => return x % 2 == 0 }.take{5}
+assert(#evens == 5 and evens[5] == 10)
+local square = tbl.map{ x => return x * x }.first{ y => return y > 200 }
+assert(square == 225, square)
+
+-- Assigned to a global variable
+anyGlobal = tbl.any{ x => return x == 1000 }
+assert(anyGlobal == true)
+anyGlobal = nil
+
+-- The result must be assigned to a name, other sites are rejected instead of being rewritten into wrong code. The transformer exits
+-- on an error, so each of them is loaded by a child process.
+local function rejected(code)
+    local path = os.tmpname()
+    local file = assert(io.open(path, "w"))
+    file:write("--[[luajit-pro]]\nlocal tbl = { 1, 2, 3 }\nlocal t = {}\n" .. code .. "\n")
+    file:close()
+    local status = os.execute(string.format("%s %s 2>/dev/null", arg[-1], path))
+    os.remove(path)
+    return status ~= 0 and status ~= true
+end
+assert(rejected("if tbl.any{ x => return x > 2 } then print(1) end"))
+assert(rejected("print(tbl.find{ x => return x > 2 })"))
+assert(rejected("t.v = tbl.first{ x => return x > 2 }"))
+assert(rejected("local r = 1 + tbl.map{ x => return x }.first{ x => return x > 2 }"))
+assert(not rejected("local r = tbl.any{ x => return x > 2 } assert(r)"))
+
+print("short_circuit: ok")
@@ -0,0 +1,43 @@
+-- Check that a large file which is transformed in windows(see LJP_STREAM_SIZE) gives the same results as a transform of the whole file.
+-- Generates a luajit-pro data module of about 20MB(5 windows) with operator sites between and inside of its records, loads it with
+-- loadfile(), which streams it, and with loadstring(), which transforms the whole buffer at once.
+-- Usage: LJP_STREAM_SIZE=1 LJP_NO_CACHE=1 ./run.sh stream.lua
+
+local parts = {
+    "--[[luajit-pro]]\n",
+    "#define SCALE 2\n",
+    "local vals = { 1, 2, 3, 4 }\n",
+    "local M = { sum = 0, data = {} }\n",
+    "$comp_time(consts) {\n    return \"M.first = 1\"\n}\n",
+    "M.data[1] = (function() return {\n",
+}
+for i = 1, 200000 do
+    if i % 1000 == 0 then
+        -- The records go into a function per 1000 of them, as a function has at most 65536 constants. Then sites at the top level, a
+        -- dense annotation and a chain spanning multiple lines.
+        parts[#parts + 1] = "} end)()\ndo\n"
+        parts[#parts + 1] = "    --[[dense]]\n    local m = vals.map{ x => return x * SCALE }\n"
+        parts[#parts + 1] = string.format("    local f = vals\n        .filter{ x => return x %% 2 == 0 }\n        .map{ x => return x + %d }\n", i)
+        parts[#parts + 1] = "    M.sum = M.sum + #m + f[1]\nend\nM.data[#M.data + 1] = (function() return {\n"
+    else
+        -- The records of a table constructor, the stream can cut between them
+        parts[#parts + 1] = string.format("    { id = %d, name = \"record %d\", f = function(t) local r = t.map{ v => return v + %d } return r[1] end },\n", i, i, i)
+    end
+end
+parts[#parts + 1] = "} end)()\nreturn M\n"
+local code = table.concat(parts)
+
+local path = os.tmpname()
+local file = assert(io.open(path, "w"))
+file:write(code)
+file:close()
+
+local streamed = assert(loadfile(path))()
+local whole = assert(loadstring(code))()
+os.remove(path)
+
+assert(streamed.first == 1 and whole.first == 1)
+assert(streamed.sum == whole.sum and streamed.sum > 0, string.format("%d ~= %d", streamed.sum, whole.sum))
+assert(#streamed.data == #whole.data and streamed.data[#streamed.data][1].f({1}) == whole.data[#whole.data][1].f({1}))
+
+print(string.format("stream: ok(%.1fMB)", #code / 1e6))